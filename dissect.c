@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xpong-dissect prints the XPong packets in a pcap capture, such as one
+ * written by tcpdump -w, one per line. Everything it knows of the packets
+ * comes from NET_FIELDS and NET_OPCODES in network.h, and -t prints them as
+ * the tables of README.org.
+ */
+
+#include "network.h"
+#include "simulate.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+#define SNAP_MAX (256 * 1024)
+
+/* Link types we can find IPv4 in. */
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LINUX_SLL 113
+#define LINK_IPV4 228
+#define LINK_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define IPPROTO_UDP_ 17
+
+typedef struct opcode_info {
+  const char *name, *what, *epoch, *input;
+} opcode_info_t;
+
+static const opcode_info_t opcodes[NET_NOPCODE] = {
+#define NET_OPCODE_INFO(name, value, what, epoch, input)                       \
+  [value] = {#name, what, epoch, input},
+    NET_OPCODES(NET_OPCODE_INFO)
+#undef NET_OPCODE_INFO
+};
+
+typedef struct stats {
+  uint64_t records, udp, packets, unknown;
+  uint64_t by_opcode[NET_NOPCODE];
+} stats_t;
+
+static void usage(const char *program_name) {
+  fprintf(stderr, "Usage: %s [-p port] <capture.pcap|->\n", program_name);
+  fprintf(stderr, "       %s -t\n", program_name);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -p port  Only datagrams from or to port\n");
+  fprintf(stderr, "  -t       Print the packet tables of README.org\n");
+}
+
+#define MAX_CELL 64
+
+static void print_row(char (*cells)[MAX_CELL], const int *width, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    printf("| %-*s ", width[i], cells[i]);
+  printf("|\n");
+}
+
+static void print_rule(const int *width, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    printf("%c%.*s", i ? '+' : '|', width[i] + 2,
+           "----------------------------------------------------------------");
+  printf("|\n");
+}
+
+/* An Org table of nrow rows of ncol cells, the first row a header. */
+static void print_table(char (*cells)[MAX_CELL], size_t nrow, size_t ncol) {
+  int width[MAX_CELL] = {0};
+  for (size_t i = 0; i < nrow * ncol; ++i) {
+    int w = strlen(cells[i]);
+    if (w > width[i % ncol])
+      width[i % ncol] = w;
+  }
+  print_row(cells, width, ncol);
+  print_rule(width, ncol);
+  for (size_t r = 1; r < nrow; ++r)
+    print_row(cells + r * ncol, width, ncol);
+}
+
+/* The tables of the protocol section of README.org. */
+static void print_tables() {
+  char ops[NET_NOPCODE + 1][4][MAX_CELL] = {
+      {"Opcode", "Operation", "Epoch field", "Input field"}};
+  for (size_t i = 0; i < NET_NOPCODE; ++i) {
+    snprintf(ops[i + 1][0], MAX_CELL, "%zu", i);
+    snprintf(ops[i + 1][1], MAX_CELL, "%s (%s)", opcodes[i].what,
+             opcodes[i].name);
+    snprintf(ops[i + 1][2], MAX_CELL, "%s", opcodes[i].epoch);
+    snprintf(ops[i + 1][3], MAX_CELL, "%s", opcodes[i].input);
+  }
+  print_table(ops[0], NET_NOPCODE + 1, 4);
+
+  enum {
+#define NET_FIELD_COUNT(name, type, bytes) FIELD_##name,
+    NET_FIELDS(NET_FIELD_COUNT)
+#undef NET_FIELD_COUNT
+    NFIELD
+  };
+  char fields[2][NFIELD][MAX_CELL];
+#define NET_FIELD_CELLS(name, type, bytes)                                     \
+  snprintf(fields[0][FIELD_##name], MAX_CELL, "%d byte%s", bytes,             \
+           bytes == 1 ? "" : "s");                                             \
+  snprintf(fields[1][FIELD_##name], MAX_CELL, "%s", #name);
+  NET_FIELDS(NET_FIELD_CELLS)
+#undef NET_FIELD_CELLS
+  printf("\nAll packets are %d bytes, big endian:\n", NET_PACKET_SIZE);
+  print_table(fields[0], 2, NFIELD);
+}
+
+static uint16_t get16(const uint8_t *b) { return b[0] << 8 | b[1]; }
+
+static uint32_t get32(const uint8_t *b, bool swap) {
+  uint32_t v;
+  memcpy(&v, b, sizeof(v));
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static void print_packet(const net_packet_t *pkt) {
+  const opcode_info_t *op = &opcodes[pkt->opcode];
+  printf("%s", op->name);
+  /* Fields with no meaning for the opcode are left out unless set. */
+  if (*op->epoch || pkt->epoch)
+    printf(" %s %u", *op->epoch ? op->epoch : "epoch",
+           (unsigned)pkt->epoch);
+  if (*op->input || pkt->input)
+    printf(" %s %u", *op->input ? op->input : "input",
+           (unsigned)pkt->input);
+
+  if (pkt->opcode == OPCODE_CMD) {
+    static const char *cmd[] = {"none", "up", "down", "?"};
+    printf(" (%s", cmd[SIM_INPUT_CMD(pkt->input)]);
+    if (pkt->input & ~3)
+      printf(" %s %u/%u", pkt->input & SIM_INPUT_UNTIL ? "until" : "from",
+             (unsigned)SIM_INPUT_AT(pkt->input), (unsigned)SIM_SUBTICK);
+    printf(")");
+  } else if (pkt->opcode == OPCODE_JOIN && pkt->input == JOIN_REJECT) {
+    printf(" (rejected)");
+  }
+}
+
+/* Print the UDP datagram in the IPv4 packet ip, if it is one of ours. */
+static void dissect_ipv4(const uint8_t *ip, size_t len, double time, int port,
+                         stats_t *stats) {
+  if (len < 20 || ip[0] >> 4 != 4)
+    return;
+  size_t ihl = (ip[0] & 0xF) * 4;
+  size_t total = get16(ip + 2);
+  /* Only whole datagrams, and not fragments of one. */
+  if (ip[9] != IPPROTO_UDP_ || ihl < 20 || total > len || total < ihl + 8 ||
+      (get16(ip + 6) & 0x3FFF))
+    return;
+  const uint8_t *udp = ip + ihl;
+  uint16_t sport = get16(udp), dport = get16(udp + 2);
+  if (port >= 0 && sport != port && dport != port)
+    return;
+  ++stats->udp;
+
+  size_t size = total - ihl - 8;
+  if (size != NET_PACKET_SIZE)
+    return;
+  net_packet_t pkt;
+  net_deserialise(&pkt, udp + 8);
+  printf("%.6f %u.%u.%u.%u:%u > %u.%u.%u.%u:%u ", time, ip[12], ip[13],
+         ip[14], ip[15], (unsigned)sport, ip[16], ip[17], ip[18], ip[19],
+         (unsigned)dport);
+  if (!net_opcode_name(pkt.opcode)) {
+    printf("unknown opcode %u\n", (unsigned)pkt.opcode);
+    ++stats->unknown;
+    return;
+  }
+  print_packet(&pkt);
+  printf("\n");
+  ++stats->packets;
+  ++stats->by_opcode[pkt.opcode];
+}
+
+static void dissect_frame(uint32_t link, const uint8_t *f, size_t len,
+                          double time, int port, stats_t *stats) {
+  switch (link) {
+  case LINK_NULL:
+    /* The address family, in the byte order of the capturing host. */
+    if (len >= 4 && (get32(f, false) == 2 || get32(f, true) == 2))
+      dissect_ipv4(f + 4, len - 4, time, port, stats);
+    break;
+  case LINK_ETHERNET: {
+    size_t off = 12;
+    while (len >= off + 2 && get16(f + off) == ETHERTYPE_VLAN)
+      off += 4;
+    if (len >= off + 2 && get16(f + off) == ETHERTYPE_IPV4)
+      dissect_ipv4(f + off + 2, len - off - 2, time, port, stats);
+    break;
+  }
+  case LINK_RAW:
+  case LINK_IPV4:
+    dissect_ipv4(f, len, time, port, stats);
+    break;
+  case LINK_LINUX_SLL:
+    if (len >= 16 && get16(f + 14) == ETHERTYPE_IPV4)
+      dissect_ipv4(f + 16, len - 16, time, port, stats);
+    break;
+  case LINK_LINUX_SLL2:
+    if (len >= 20 && get16(f) == ETHERTYPE_IPV4)
+      dissect_ipv4(f + 20, len - 20, time, port, stats);
+    break;
+  }
+}
+
+static int dissect(FILE *in, const char *path, int port) {
+  uint8_t header[PCAP_HEADER_SIZE];
+  if (fread(header, 1, sizeof(header), in) != sizeof(header)) {
+    fprintf(stderr, "%s is not a pcap capture\n", path);
+    return 1;
+  }
+  uint32_t magic = get32(header, false);
+  bool swap = magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+              magic == __builtin_bswap32(PCAP_MAGIC_NS);
+  magic = get32(header, swap);
+  if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+    fprintf(stderr, "%s is not a pcap capture (pcapng is not supported)\n",
+            path);
+    return 1;
+  }
+  double tick = magic == PCAP_MAGIC_NS ? 1e-9 : 1e-6;
+  uint32_t link = get32(header + 20, swap) & 0xFFFF;
+
+  static uint8_t frame[SNAP_MAX];
+  uint8_t record[PCAP_RECORD_SIZE];
+  stats_t stats = {0};
+  while (fread(record, 1, sizeof(record), in) == sizeof(record)) {
+    double time = get32(record, swap) + get32(record + 4, swap) * tick;
+    uint32_t len = get32(record + 8, swap);
+    if (len > sizeof(frame) || fread(frame, 1, len, in) != len) {
+      fprintf(stderr, "%s is truncated\n", path);
+      break;
+    }
+    ++stats.records;
+    dissect_frame(link, frame, len, time, port, &stats);
+  }
+
+  fprintf(stderr, "%" PRIu64 " frames, %" PRIu64 " UDP datagrams, %" PRIu64
+                  " XPong packets",
+          stats.records, stats.udp, stats.packets);
+  for (size_t i = 0; i < NET_NOPCODE; ++i) {
+    if (stats.by_opcode[i])
+      fprintf(stderr, ", %" PRIu64 " %s", stats.by_opcode[i],
+              opcodes[i].name);
+  }
+  if (stats.unknown)
+    fprintf(stderr, ", %" PRIu64 " unknown", stats.unknown);
+  fprintf(stderr, "\n");
+  return 0;
+}
+
+int main(int argc, char *argv[argc + 1]) {
+  int port = -1;
+  bool tables = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:t")) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 't':
+      tables = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (tables) {
+    print_tables();
+    return 0;
+  }
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char *path = argv[optind];
+  FILE *in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+  if (!in) {
+    perror(path);
+    return 1;
+  }
+  int ret = dissect(in, path, port);
+  if (in != stdin)
+    fclose(in);
+  return ret;
+}
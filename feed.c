@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "feed.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct feed {
+  int fd;
+  feed_ring_t *ring;
+  uint64_t head;
+};
+
+static const size_t RING_SIZE =
+    sizeof(feed_ring_t) + FEED_NSLOT * sizeof(feed_entry_t);
+
+feed_t *feed_create() {
+  feed_t *f = calloc(1, sizeof(*f));
+  if (!f) {
+    perror("calloc");
+    return NULL;
+  }
+
+  f->fd = memfd_create("xpong-feed", MFD_CLOEXEC);
+  if (f->fd < 0) {
+    perror("memfd_create");
+    free(f);
+    return NULL;
+  }
+  if (ftruncate(f->fd, RING_SIZE) < 0) {
+    perror("ftruncate");
+    close(f->fd);
+    free(f);
+    return NULL;
+  }
+  f->ring = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+  if (f->ring == MAP_FAILED) {
+    perror("mmap");
+    close(f->fd);
+    free(f);
+    return NULL;
+  }
+
+  f->ring->nslot = FEED_NSLOT;
+  f->ring->nplayer = NPLAYER;
+  atomic_store_explicit(&f->ring->head, 0, memory_order_relaxed);
+  /* Readers check the magic last. */
+  atomic_thread_fence(memory_order_release);
+  f->ring->magic = FEED_MAGIC;
+  fprintf(stderr, "feed at /proc/%d/fd/%d\n", (int)getpid(), f->fd);
+  return f;
+}
+
+void feed_publish(feed_t *f, const cmd_t cmds[NPLAYER], uint64_t hash) {
+  feed_entry_t *e = &f->ring->entries[f->head % FEED_NSLOT];
+  atomic_store_explicit(&e->stamp, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  e->hash = hash;
+  for (size_t i = 0; i < NPLAYER; ++i)
+    e->cmds[i] = cmds[i];
+  ++f->head;
+  atomic_store_explicit(&e->stamp, (uint32_t)f->head, memory_order_release);
+  atomic_store_explicit(&f->ring->head, f->head, memory_order_release);
+}
+
+void feed_close(feed_t *f) {
+  if (!f)
+    return;
+  atomic_store_explicit(&f->ring->closed, 1, memory_order_release);
+  munmap(f->ring, RING_SIZE);
+  close(f->fd);
+  free(f);
+}
+
+const feed_ring_t *feed_attach(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < RING_SIZE) {
+    fprintf(stderr, "%s is not an xpong feed\n", path);
+    close(fd);
+    return NULL;
+  }
+  const feed_ring_t *r = mmap(NULL, RING_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (r == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  if (r->magic != FEED_MAGIC || r->nslot != FEED_NSLOT ||
+      r->nplayer != NPLAYER) {
+    fprintf(stderr, "%s is not an xpong feed\n", path);
+    munmap((void *)r, RING_SIZE);
+    return NULL;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  return r;
+}
+
+static uint64_t ring_head(const feed_ring_t *r) {
+  return atomic_load_explicit((_Atomic uint64_t *)&r->head,
+                              memory_order_acquire);
+}
+
+int feed_read(const feed_ring_t *r, uint64_t *next, feed_entry_t *e) {
+  uint64_t head = ring_head(r);
+  if (*next >= head)
+    return 0;
+  if (head - *next > FEED_NSLOT) {
+    *next = head - FEED_NSLOT;
+    return -1;
+  }
+
+  /* The writer may lap us while we copy, which the stamp shows. Skip to
+   * the oldest entry it cannot be writing to next. */
+  feed_entry_t *slot = (feed_entry_t *)&r->entries[*next % FEED_NSLOT];
+  uint32_t stamp = (uint32_t)(*next + 1);
+  bool lapped =
+      atomic_load_explicit(&slot->stamp, memory_order_acquire) != stamp;
+  if (!lapped) {
+    e->hash = slot->hash;
+    memcpy(e->cmds, slot->cmds, NPLAYER);
+    atomic_thread_fence(memory_order_acquire);
+    lapped = atomic_load_explicit(&slot->stamp, memory_order_relaxed) != stamp;
+  }
+  if (lapped) {
+    *next = ring_head(r) - FEED_NSLOT + 1;
+    return -1;
+  }
+
+  atomic_store_explicit(&e->stamp, stamp, memory_order_relaxed);
+  ++*next;
+  return 1;
+}
+
+void feed_detach(const feed_ring_t *r) { munmap((void *)r, RING_SIZE); }
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef FEED_H
+#define FEED_H
+
+#include "simulate.h"
+
+#include <stdint.h>
+
+/*
+ * Feed of confirmed epochs to other processes: a ring in shared memory
+ * that the game writes each simulated epoch into, and any number of
+ * readers map and read in place. The writer never waits for readers. A
+ * reader that falls more than FEED_NSLOT epochs behind loses the oldest
+ * ones and is told so.
+ *
+ * The ring lives in a memfd. Readers attach through /proc/<pid>/fd/<fd>
+ * of the game, which feed_create prints.
+ */
+
+#define FEED_MAGIC 0x78706f6e67666430ull /* "xpongfd0" */
+#define FEED_NSLOT 4096
+
+/* Entry n is the n-th confirmed epoch. stamp is n + 1 once the entry is
+ * complete, and 0 while it is being written. */
+typedef struct feed_entry {
+  uint64_t hash;
+  _Atomic uint32_t stamp;
+  uint8_t cmds[NPLAYER];
+} feed_entry_t;
+
+typedef struct feed_ring {
+  uint64_t magic;
+  uint32_t nslot, nplayer;
+  /* Entries published so far, and whether the writer has gone. */
+  _Atomic uint64_t head;
+  _Atomic uint32_t closed;
+  feed_entry_t entries[] __attribute__((aligned(64)));
+} feed_ring_t;
+
+typedef struct feed feed_t;
+
+feed_t *feed_create();
+/* Publish the next epoch, its inputs and sim_hash of the state after it. */
+void feed_publish(feed_t *f, const cmd_t cmds[NPLAYER], uint64_t hash);
+void feed_close(feed_t *f);
+
+/* Map the ring of a game read-only, NULL on failure. */
+const feed_ring_t *feed_attach(const char *path);
+/* Copy entry *next into e and advance *next, returning 1. Returns 0 if it
+ * is not published yet, and -1 if it has been overwritten, in which case
+ * *next moves to the oldest entry still in the ring. */
+int feed_read(const feed_ring_t *r, uint64_t *next, feed_entry_t *e);
+void feed_detach(const feed_ring_t *r);
+
+#endif
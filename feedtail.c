@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "feed.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Print the epochs of a game's feed as they are confirmed. */
+int main(int argc, char *argv[argc + 1]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s /proc/<pid>/fd/<fd>\n", argv[0]);
+    return 1;
+  }
+  const feed_ring_t *r = feed_attach(argv[1]);
+  if (!r)
+    return 1;
+
+  uint64_t next = 0;
+  for (;;) {
+    feed_entry_t e;
+    int got = feed_read(r, &next, &e);
+    if (got > 0) {
+      printf("%" PRIu64 " %u %u %016" PRIx64 "\n", next - 1,
+             (unsigned)e.cmds[0], (unsigned)e.cmds[1], e.hash);
+    } else if (got < 0) {
+      fprintf(stderr, "fell behind, skipping to epoch %" PRIu64 "\n", next);
+    } else if (atomic_load((_Atomic uint32_t *)&r->closed)) {
+      break;
+    } else {
+      fflush(stdout);
+      nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+  }
+
+  feed_detach(r);
+  return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "netmode.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint32_t PROBE_INTERVAL = 50;
+/* A probe unanswered for this long is lost. */
+static const uint32_t PROBE_TIMEOUT = 1000;
+/* Measure this long before the first decision, and decide this often. */
+static const uint32_t DECISION_INTERVAL = 1000;
+static const uint32_t MIN_ANSWERS = 10;
+/* Above this loss rate, budget a repeat for every command. */
+static const float LOSS_SLACK = 0.02f;
+
+void netmode_init(netmode_t *m, int player, uint32_t tick_ms,
+                  uint8_t max_delay) {
+  memset(m, 0, sizeof(*m));
+  m->player = player;
+  m->tick_ms = tick_ms;
+  m->max_delay = max_delay < NETMODE_MAX_DELAY ? max_delay : NETMODE_MAX_DELAY;
+  m->confirmed = true;
+}
+
+static void send_packet(uint8_t opcode, uint16_t epoch, uint8_t input) {
+  net_packet_t pkt = {.opcode = opcode, .epoch = epoch, .input = input};
+  net_send(&pkt);
+}
+
+static void sample(netmode_t *m, float rtt) {
+  if (!m->answered) {
+    m->srtt = rtt;
+    m->rttvar = rtt / 2;
+  } else {
+    m->rttvar = 0.75f * m->rttvar + 0.25f * fabsf(m->srtt - rtt);
+    m->srtt = 0.875f * m->srtt + 0.125f * rtt;
+  }
+  m->loss *= 0.95f;
+  ++m->answered;
+}
+
+int netmode_handle(netmode_t *m, const net_packet_t *pkt, uint32_t tick) {
+  switch (pkt->opcode) {
+  case OPCODE_PING:
+    send_packet(OPCODE_PONG, pkt->epoch, 0);
+    return 1;
+
+  case OPCODE_PONG: {
+    size_t i = pkt->epoch % NETMODE_NPROBE;
+    if (m->outstanding[i] && (uint16_t)(m->seq - pkt->epoch) <= NETMODE_NPROBE) {
+      m->outstanding[i] = false;
+      if (!m->heard) {
+        m->heard = true;
+        m->last_decision_tick = tick;
+      }
+      sample(m, tick - m->probe_tick[i]);
+    }
+    return 1;
+  }
+
+  case OPCODE_MODE:
+    if (pkt->input > NETMODE_MAX_DELAY)
+      return 1;
+    if (m->player == 0) {
+      if (pkt->epoch == m->switch_epoch && pkt->input == m->next_delay)
+        m->confirmed = true;
+      return 1;
+    }
+
+    /* Player 1 follows, and ignores announcements older than the one it
+     * has. */
+    if (!m->switches || (int16_t)(pkt->epoch - m->switch_epoch) > 0) {
+      m->switch_epoch = pkt->epoch;
+      m->next_delay = pkt->input;
+      m->pending = true;
+      ++m->switches;
+    }
+    send_packet(OPCODE_MODE, m->switch_epoch, m->next_delay);
+    return 1;
+  }
+  return 0;
+}
+
+/* The smallest delay that hides the measured link. Our command for epoch e
+ * goes out when we start epoch e - delay, and it must be acknowledged and
+ * the peer's command in by the tick after we start epoch e - 1. */
+static uint8_t wanted_delay(netmode_t *m) {
+  float budget = m->srtt + 4 * m->rttvar;
+  if (m->loss > LOSS_SLACK)
+    budget += m->tick_ms;
+  uint32_t ticks = ceilf(budget / m->tick_ms);
+  uint32_t delay = ticks ? ticks - 1 : 0;
+
+  m->capped = delay > m->max_delay;
+  return m->capped ? m->max_delay : delay;
+}
+
+static void decide(netmode_t *m, uint16_t epoch) {
+  uint8_t wanted = wanted_delay(m);
+  /* Go up at once, come down one step per decision. */
+  uint8_t delay = m->delay;
+  if (wanted > delay)
+    delay = wanted;
+  else if (wanted < delay)
+    --delay;
+  if (delay == m->delay)
+    return;
+
+  /* Leave time for the announcement to reach player 1 before the switch,
+   * and for the epochs we already sent commands for. */
+  uint32_t lead = m->delay + ceilf(m->srtt / m->tick_ms) + 2;
+  m->switch_epoch = epoch + lead;
+  m->next_delay = delay;
+  m->pending = true;
+  m->confirmed = false;
+  ++m->switches;
+}
+
+void netmode_poll(netmode_t *m, uint16_t epoch, uint32_t tick) {
+  /* Expire probes, counting only those sent since the peer answered. */
+  for (size_t i = 0; i < NETMODE_NPROBE; ++i) {
+    if (m->outstanding[i] && tick - m->probe_tick[i] >= PROBE_TIMEOUT) {
+      m->outstanding[i] = false;
+      if (m->heard) {
+        m->loss = 0.95f * m->loss + 0.05f;
+        ++m->lost;
+      }
+    }
+  }
+
+  if (tick - m->last_probe_tick >= PROBE_INTERVAL) {
+    size_t i = m->seq % NETMODE_NPROBE;
+    m->probe_tick[i] = tick;
+    m->outstanding[i] = true;
+    send_packet(OPCODE_PING, m->seq++, 0);
+    m->last_probe_tick = tick;
+  }
+
+  if (m->player != 0)
+    return;
+  if (!m->confirmed) {
+    send_packet(OPCODE_MODE, m->switch_epoch, m->next_delay);
+  } else if (!m->pending && m->answered >= MIN_ANSWERS &&
+             tick - m->last_decision_tick >= DECISION_INTERVAL) {
+    decide(m, epoch);
+    m->last_decision_tick = tick;
+  }
+}
+
+uint8_t netmode_delay(netmode_t *m, uint16_t epoch) {
+  /* The peer is at most a delay and an epoch behind, so by now it has left
+   * the old delay, if it has heard of the change. */
+  if (m->confirmed && (int16_t)(epoch - m->retired_until) >= 0)
+    m->retired = 0;
+
+  /* Player 0 lowers the delay on time, as player 1 never assumes less than
+   * the old one until it hears of the change, but waits for player 1 to
+   * hear of a raise. */
+  bool known = m->player != 0 || m->confirmed || m->next_delay < m->delay;
+  if (m->pending && (int16_t)(epoch - m->switch_epoch) >= 0 && known) {
+    m->pending = false;
+    if (m->delay > m->retired)
+      m->retired = m->delay;
+    m->retired_until = epoch + NETMODE_MAX_DELAY + 1;
+    if (m->delay != m->next_delay)
+      fprintf(stderr, "epoch %u: input delay %u -> %u (rtt %.1f ms, jitter "
+                      "%.1f ms, loss %.1f%%)\n",
+              (unsigned)epoch, (unsigned)m->delay, (unsigned)m->next_delay,
+              m->srtt, m->rttvar, 100 * m->loss);
+    m->delay = m->next_delay;
+  }
+  return m->delay;
+}
+
+uint8_t netmode_peer_delay(const netmode_t *m) {
+  uint8_t delay = m->delay;
+  if (m->switches && m->next_delay > delay)
+    delay = m->next_delay;
+  if (m->retired > delay)
+    delay = m->retired;
+  return delay;
+}
+
+uint32_t netmode_rtt(const netmode_t *m) {
+  return m->heard ? ceilf(m->srtt) : 0;
+}
+
+void netmode_report(const netmode_t *m) {
+  if (!m->answered)
+    return;
+
+  fprintf(stderr, "link: rtt %.1f ms, jitter %.1f ms, %u/%u probes lost\n",
+          m->srtt, m->rttvar, (unsigned)m->lost,
+          (unsigned)(m->answered + m->lost));
+  fprintf(stderr, "input delay %u (%s), %u changes\n", (unsigned)m->delay,
+          m->delay ? "delayed lockstep" : "lockstep", (unsigned)m->switches);
+  if (m->capped)
+    fprintf(stderr, "link needs more than %u ticks of delay, the match "
+                    "stalled\n",
+            (unsigned)m->max_delay);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NETMODE_H
+#define NETMODE_H
+
+#include "network.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Picks the synchronisation mode of a match from the quality of the link.
+ *
+ * The mode is an input delay: the input read at the start of epoch e is
+ * the player's command for epoch e + delay. Delay 0 is plain lockstep and
+ * stalls for a round trip every epoch once the round trip is longer than
+ * a tick. A delay of d ticks hides a round trip of up to d ticks.
+ *
+ * Both peers probe the link with PING packets and measure round trip,
+ * jitter and loss from the PONG answers. Player 0 decides, and announces
+ * a change with a MODE packet carrying the epoch it takes effect at and
+ * the new delay, repeated until player 1 echoes it. Player 0 only raises
+ * the delay once the echo is in, so that each peer knows every delay the
+ * other may be sending commands ahead with, see netmode_peer_delay.
+ */
+
+/* Largest delay, and the epochs the peers can be apart in the window of
+ * commands they keep. */
+#define NETMODE_MAX_DELAY 8
+#define NETMODE_WINDOW (4 * NETMODE_MAX_DELAY)
+
+#define NETMODE_NPROBE 32
+
+typedef struct netmode {
+  int player;
+  uint32_t tick_ms;
+  uint8_t max_delay;
+
+  /* Delay in use, and a change that waits for its epoch. */
+  uint8_t delay;
+  bool pending, confirmed;
+  uint16_t switch_epoch;
+  uint8_t next_delay;
+  /* The largest delay before the last changes, which the peer may still
+   * be using until the epoch retired_until, or until player 1 has heard of
+   * the change. */
+  uint8_t retired;
+  uint16_t retired_until;
+
+  /* Probes by sequence number % NETMODE_NPROBE. */
+  uint16_t seq;
+  uint32_t probe_tick[NETMODE_NPROBE];
+  bool outstanding[NETMODE_NPROBE];
+  uint32_t last_probe_tick, last_decision_tick;
+
+  /* Smoothed round trip and its mean deviation in ms, and the fraction of
+   * probes lost. Nothing is measured until the first answer. */
+  bool heard;
+  float srtt, rttvar, loss;
+
+  /* Statistics */
+  uint32_t answered, lost, switches;
+  bool capped;
+} netmode_t;
+
+/* max_delay is at most NETMODE_MAX_DELAY. Starts in plain lockstep. */
+void netmode_init(netmode_t *m, int player, uint32_t tick_ms,
+                  uint8_t max_delay);
+
+/* Handle a PING, PONG or MODE packet received at tick, and return 1. Other
+ * packets are left to the caller and 0 returned. */
+int netmode_handle(netmode_t *m, const net_packet_t *pkt, uint32_t tick);
+
+/* Send probes and, on player 0, announce mode changes. Once per tick. */
+void netmode_poll(netmode_t *m, uint16_t epoch, uint32_t tick);
+
+/* The delay of epoch, which must be the next epoch to simulate. */
+uint8_t netmode_delay(netmode_t *m, uint16_t epoch);
+
+/* The largest delay the peer may have sent its commands with. A command
+ * from the peer for epoch e means it has reached epoch e - the delay, and
+ * so has all of our commands before that. */
+uint8_t netmode_peer_delay(const netmode_t *m);
+
+/* The smoothed round trip in ms, 0 until it is measured. */
+uint32_t netmode_rtt(const netmode_t *m);
+
+void netmode_report(const netmode_t *m);
+
+#endif
@@ -22,13 +22,60 @@
 #include <assert.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#endif
+
 static int sock;
 static struct sockaddr_in sock_addr_other;
+/* Talking to a relay, which may move us to another address. Only a JOIN
+ * from its host, for the session and player we asked for, does. */
+static bool relay;
+static struct in_addr relay_host;
+static uint16_t relay_session;
+static uint8_t relay_player;
+/* Kernel receive time of the last packet polled. */
+static uint64_t rx_time;
+
+/* Packets held by net_send_at until their time. */
+#define PACE_QUEUE 64
+/* Paced packets checked against their transmit timestamps before the
+ * kernel is trusted to hold them, and how many may go by without one. */
+#define PACE_CHECK 16
+#define PACE_CHECK_MAX (8 * PACE_CHECK)
+/* A packet leaving this long before its time was not held. */
+#define PACE_EARLY_NS 200000
+
+typedef struct paced {
+  unsigned char buff[NET_PACKET_SIZE];
+  uint64_t when;
+} paced_t;
+
+static net_pace_t pace;
+static paced_t pace_queue[PACE_QUEUE];
+static size_t pace_head, pace_len;
+
+/* While checking, when each datagram was sent and was meant to leave, by
+ * the id of its transmit timestamp. */
+static bool pace_checking;
+static uint32_t pace_nsent;
+static uint64_t pace_sent[PACE_QUEUE], pace_when[PACE_QUEUE];
+static uint32_t pace_checked, pace_early;
+
+/* Statistics */
+static uint32_t pace_npaced, pace_held, pace_due;
+static uint64_t pace_late_sum, pace_late_max;
 
 void net_init(unsigned short port_self, const char *hostname_other,
               unsigned short port_other) {
@@ -83,29 +130,248 @@ void net_init(unsigned short port_self, const char *hostname_other,
     }
     sock_addr_other.sin_addr = *(struct in_addr *)host->h_addr_list[0];
   }
+
+  net_filter(sock);
+
+#ifdef SO_TIMESTAMPNS
+  int on = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    perror("SO_TIMESTAMPNS");
+#endif
+}
+
+void net_filter(int fd) {
+#ifdef SO_ATTACH_FILTER
+  /* The filter sees the datagram from its UDP header. */
+  struct sock_filter code[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+               sizeof(struct udphdr) + NET_PACKET_SIZE, 0, 3),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+               sizeof(struct udphdr) + offsetof(net_wire_t, opcode)),
+      BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, OPCODE_MAX, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    perror("SO_ATTACH_FILTER");
+#endif
 }
 
 void net_fini() { close(sock);/* TODO: Shutdown the socket. */ }
 
-static void serialise(unsigned char *buff, const net_packet_t *pkt) {
-  /* TODO:
-   *
-   * Serialise the packet according to the protocol.
-   *
-   * Note that it must use network endian.
-   */
+/* Every field fits its C type and a word, and every opcode has a name: a
+ * gap or a repeated value in NET_OPCODES fails to compile here. */
+#define NET_FIELD_FITS(name, type, bytes)                                      \
+  _Static_assert((bytes) <= sizeof(type) && (bytes) <= sizeof(uint32_t),     \
+                 #name " is wider than its type");
+NET_FIELDS(NET_FIELD_FITS)
+#undef NET_FIELD_FITS
+
+#define NET_OPCODE_DENSE(name, value, ...)                                     \
+  _Static_assert((value) < NET_NOPCODE, "opcode " #name " leaves a gap");
+NET_OPCODES(NET_OPCODE_DENSE)
+#undef NET_OPCODE_DENSE
+
+const char *net_opcode_name(uint8_t opcode) {
+  switch (opcode) {
+#define NET_OPCODE_CASE(name, value, ...)                                      \
+  case value:                                                                  \
+    return #name;
+    NET_OPCODES(NET_OPCODE_CASE)
+#undef NET_OPCODE_CASE
+  }
+  return NULL;
+}
+
+static inline __attribute__((always_inline)) void
+put_be(unsigned char *b, uint32_t v, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    b[i] = v >> 8 * (n - 1 - i);
+}
+
+static inline __attribute__((always_inline)) uint32_t
+get_be(const unsigned char *b, size_t n) {
+  uint32_t v = 0;
+  for (size_t i = 0; i < n; ++i)
+    v = v << 8 | b[i];
+  return v;
+}
+
+/* The packet as one big-endian word, each field at its wire offset. */
+_Static_assert(NET_PACKET_SIZE <= sizeof(uint32_t), "a packet fits a word");
+#define NET_SHIFT(name, bytes)                                                 \
+  (8 * (NET_PACKET_SIZE - offsetof(net_wire_t, name) - (bytes)))
+
+static inline __attribute__((always_inline)) void
+serialise(unsigned char *buff, const net_packet_t *pkt) {
+  uint32_t w = 0;
+#define NET_FIELD_PUT(name, type, bytes)                                       \
+  w |= (uint32_t)pkt->name << NET_SHIFT(name, bytes);
+  NET_FIELDS(NET_FIELD_PUT)
+#undef NET_FIELD_PUT
+  put_be(buff, w, NET_PACKET_SIZE);
+}
 
-  buff[0] = pkt->opcode;
-  buff[1] = pkt->epoch >> 8;
-  buff[2] = pkt->epoch & 0xFF;
-  buff[3] = pkt->input;
+static inline __attribute__((always_inline)) void
+deserialise(net_packet_t *pkt, const unsigned char *buff) {
+  uint32_t w = get_be(buff, NET_PACKET_SIZE);
+#define NET_FIELD_GET(name, type, bytes)                                       \
+  pkt->name = w >> NET_SHIFT(name, bytes) & (uint32_t)-1 >> (32 - 8 * (bytes));
+  NET_FIELDS(NET_FIELD_GET)
+#undef NET_FIELD_GET
+}
+
+void net_serialise(unsigned char *buff, const net_packet_t *pkt) {
+  serialise(buff, pkt);
+}
+
+void net_deserialise(net_packet_t *pkt, const unsigned char *buff) {
+  deserialise(pkt, buff);
+}
+
+/*
+ * Batch codecs. Each packet is one word, so the loops come down to loads,
+ * byte swaps, shifts and stores that the compiler unrolls and, where it
+ * pays, vectorises for the instruction set at hand.
+ */
+
+typedef struct net_codec {
+  const char *name;
+  int (*supported)();
+  void (*serialise)(unsigned char *, size_t, const net_packet_t *, size_t);
+  void (*deserialise)(net_packet_t *, const unsigned char *, size_t, size_t);
+} net_codec_t;
+
+#define NET_CODEC(isa, target_isa)                                             \
+  target_isa static void serialise_batch_##isa(                               \
+      unsigned char *buff, size_t stride, const net_packet_t *pkts,            \
+      size_t n) {                                                              \
+    for (size_t i = 0; i < n; ++i)                                             \
+      serialise(buff + i * stride, &pkts[i]);                                  \
+  }                                                                            \
+  target_isa static void deserialise_batch_##isa(                             \
+      net_packet_t *pkts, const unsigned char *buff, size_t stride,            \
+      size_t n) {                                                              \
+    for (size_t i = 0; i < n; ++i)                                             \
+      deserialise(&pkts[i], buff + i * stride);                                \
+  }
+
+static int always() { return 1; }
+
+#if defined(__x86_64__) || defined(__i386__)
+NET_CODEC(sse2, )
+NET_CODEC(avx2, __attribute__((target("avx2"))))
+
+static int has_avx2() { return __builtin_cpu_supports("avx2"); }
+
+/* In ascending order of preference. */
+static const net_codec_t codecs[] = {
+    {"sse2", always, serialise_batch_sse2, deserialise_batch_sse2},
+    {"avx2", has_avx2, serialise_batch_avx2, deserialise_batch_avx2},
+};
+#elif defined(__aarch64__)
+NET_CODEC(neon, )
+
+static const net_codec_t codecs[] = {
+    {"neon", always, serialise_batch_neon, deserialise_batch_neon},
+};
+#else
+NET_CODEC(scalar, )
+
+static const net_codec_t codecs[] = {
+    {"scalar", always, serialise_batch_scalar, deserialise_batch_scalar},
+};
+#endif
+
+#define NCODEC (sizeof(codecs) / sizeof(codecs[0]))
+
+static const net_codec_t *codec = &codecs[0];
+
+__attribute__((constructor)) static void select_codec() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#endif
+  for (size_t i = 0; i < NCODEC; ++i) {
+    if (codecs[i].supported())
+      codec = &codecs[i];
+  }
 }
 
-static void deserialise(net_packet_t *pkt, const unsigned char *buff) {
-  /* TODO: Deserialise the packet into the net_packet structure. */
-  pkt->opcode = buff[0];
-  pkt->epoch = (buff[1] << 8) | buff[2];
-  pkt->input = buff[3];
+void net_serialise_batch(unsigned char *buff, size_t stride,
+                         const net_packet_t *pkts, size_t n) {
+  codec->serialise(buff, stride, pkts, n);
+}
+
+void net_deserialise_batch(net_packet_t *pkts, const unsigned char *buff,
+                           size_t stride, size_t n) {
+  codec->deserialise(pkts, buff, stride, n);
+}
+
+const char *net_codec_name() { return codec->name; }
+
+static uint32_t selftest_rand(uint32_t *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
+
+int net_selftest() {
+  /* A stride that is not the packet size, as in relay trunk records. */
+  enum { NPKT = 1024, STRIDE = NET_PACKET_SIZE + 3 };
+  static net_packet_t pkts[NPKT], got[NPKT];
+  static unsigned char bytes[NPKT * STRIDE], ref[NPKT * STRIDE],
+      out[NPKT * STRIDE];
+  uint32_t seed = 1;
+
+  /* Random values of each field's wire width, and random bytes. */
+  for (size_t i = 0; i < NPKT; ++i) {
+#define NET_FIELD_RANDOM(name, type, bytes)                                    \
+  pkts[i].name = (selftest_rand(&seed) << 16 | selftest_rand(&seed)) &         \
+                 (uint32_t)-1 >> (32 - 8 * (bytes));
+    NET_FIELDS(NET_FIELD_RANDOM)
+#undef NET_FIELD_RANDOM
+  }
+  for (size_t i = 0; i < sizeof(bytes); ++i)
+    bytes[i] = selftest_rand(&seed);
+
+  int failed = 0;
+  for (size_t k = 0; k < NCODEC; ++k) {
+    if (!codecs[k].supported())
+      continue;
+
+    int bad = 0;
+    for (size_t stride = NET_PACKET_SIZE; stride <= STRIDE;
+         stride += STRIDE - NET_PACKET_SIZE) {
+      memset(ref, 0, sizeof(ref));
+      memset(out, 0, sizeof(out));
+      for (size_t i = 0; i < NPKT; ++i)
+        serialise(ref + i * stride, &pkts[i]);
+      codecs[k].serialise(out, stride, pkts, NPKT);
+      codecs[k].deserialise(got, out, stride, NPKT);
+      bad |= memcmp(out, ref, sizeof(ref)) != 0;
+      for (size_t i = 0; i < NPKT; ++i) {
+#define NET_FIELD_DIFFERS(name, type, bytes) bad |= got[i].name != pkts[i].name;
+        NET_FIELDS(NET_FIELD_DIFFERS)
+#undef NET_FIELD_DIFFERS
+      }
+
+      /* Every bit of the wire format is a bit of some field. */
+      memcpy(ref, bytes, sizeof(ref));
+      memcpy(out, bytes, sizeof(out));
+      codecs[k].deserialise(got, bytes, stride, NPKT);
+      codecs[k].serialise(out, stride, got, NPKT);
+      bad |= memcmp(out, ref, sizeof(ref)) != 0;
+    }
+
+    if (bad) {
+      fprintf(stderr, "net codec %s does not round-trip\n", codecs[k].name);
+      if (codec == &codecs[k])
+        codec = &codecs[0];
+      ++failed;
+    }
+  }
+  return failed;
 }
 
 int net_poll(net_packet_t *pkt) {
@@ -130,20 +396,231 @@ int net_poll(net_packet_t *pkt) {
   }
 
   // There is data to read; read 4 bytes into buffer.
-  unsigned char buff[4];
-  int bytes_read = read(sock, buff, sizeof(buff));
-  if (bytes_read != 4) {
+  unsigned char buff[NET_PACKET_SIZE];
+  struct sockaddr_in from;
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct iovec iov = {buff, sizeof(buff)};
+  struct msghdr msg = {.msg_name = &from,
+                       .msg_namelen = sizeof(from),
+                       .msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  /* Transmit timestamps waiting on the error queue also wake select. */
+  int bytes_read = recvmsg(sock, &msg, MSG_DONTWAIT);
+  if (bytes_read != NET_PACKET_SIZE) {
     // Not a valid full packet, treat as no packet.
     return 0;
   }
-  deserialise(pkt, buff);
+  rx_time = 0;
+#ifdef SO_TIMESTAMPNS
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      rx_time = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+#endif
+  net_deserialise(pkt, buff);
+  if (relay && pkt->opcode == OPCODE_JOIN) {
+    if (from.sin_addr.s_addr != relay_host.s_addr ||
+        pkt->epoch != relay_session ||
+        (pkt->input != relay_player && pkt->input != JOIN_REJECT))
+      return 0;
+    if (pkt->input != JOIN_REJECT)
+      sock_addr_other = from;
+  }
   return 1;
 }
 
+/* Send a datagram, in the kernel's hands from when if txtime. */
+static void send_buff(const unsigned char *buff, uint64_t when, bool txtime) {
+  struct iovec iov = {(void *)buff, NET_PACKET_SIZE};
+  struct msghdr msg = {.msg_name = &sock_addr_other,
+                       .msg_namelen = sizeof(sock_addr_other),
+                       .msg_iov = &iov,
+                       .msg_iovlen = 1};
+#ifdef SO_TXTIME
+  char control[CMSG_SPACE(sizeof(when))] = {0};
+  if (txtime) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_TXTIME;
+    c->cmsg_len = CMSG_LEN(sizeof(when));
+    memcpy(CMSG_DATA(c), &when, sizeof(when));
+  }
+#endif
+  if (sendmsg(sock, &msg, 0) < 0 || !pace_checking)
+    return;
+  pace_sent[pace_nsent % PACE_QUEUE] = net_clock();
+  pace_when[pace_nsent % PACE_QUEUE] = txtime ? when : 0;
+  ++pace_nsent;
+}
+
 void net_send(const net_packet_t *pkt) {
   /* TODO: Serialise and send the packet to the other's socket. */
 
-  unsigned char buff[4];
-  serialise(buff, pkt);
-  sendto(sock, buff, sizeof(buff), 0, (struct sockaddr *)&sock_addr_other, sizeof(sock_addr_other));
+  unsigned char buff[NET_PACKET_SIZE];
+  net_serialise(buff, pkt);
+  send_buff(buff, 0, false);
+}
+
+uint64_t net_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t net_rx_time() { return rx_time; }
+
+net_pace_t net_pace_init(bool kernel) {
+  pace = NET_PACE_USER;
+#if defined(SO_TXTIME) && defined(SO_TIMESTAMPING)
+  struct sock_txtime txtime = {CLOCK_MONOTONIC, 0};
+  if (kernel &&
+      setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) {
+    perror("SO_TXTIME");
+  } else if (kernel) {
+    /* Without the fq qdisc the kernel sends at once whatever the time
+     * says, so see when the first few packets really leave. etf would
+     * not do either, as it wants CLOCK_TAI times. */
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                   sizeof(flags)) < 0)
+      perror("SO_TIMESTAMPING");
+    else
+      pace_checking = true;
+    pace = NET_PACE_KERNEL;
+  }
+#endif
+  return pace;
+}
+
+static void stop_checking(net_pace_t verdict) {
+#ifdef SO_TIMESTAMPING
+  int flags = 0;
+  setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+  char control[256];
+  struct msghdr msg = {.msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  while (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0)
+    msg.msg_controllen = sizeof(control);
+#endif
+  pace_checking = false;
+  pace = verdict;
+  if (verdict == NET_PACE_USER)
+    fprintf(stderr, "%u of %u packets left before their SO_TXTIME, timing "
+                    "them in user space\n",
+            (unsigned)pace_early, (unsigned)pace_checked);
+}
+
+/* Compare the transmit timestamps on the error queue with the times the
+ * packets were meant to leave. */
+static void check_timestamps() {
+#ifdef SO_TIMESTAMPING
+  char control[256];
+  for (;;) {
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+    struct scm_timestamping ts = {0};
+    struct sock_extended_err err = {0};
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c;
+         c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING)
+        memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      else if (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+        memcpy(&err, CMSG_DATA(c), sizeof(err));
+    }
+    uint32_t id = err.ee_data;
+    if (err.ee_origin != SO_EE_ORIGIN_TIMESTAMPING || !ts.ts[0].tv_sec ||
+        id >= pace_nsent || pace_nsent - id > PACE_QUEUE)
+      continue;
+    /* Only a packet handed over well before its time tells whether the
+     * kernel held it. */
+    uint64_t when = pace_when[id % PACE_QUEUE];
+    if (!when || when < pace_sent[id % PACE_QUEUE] + 2 * PACE_EARLY_NS)
+      continue;
+
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    int64_t left = ts.ts[0].tv_sec * 1000000000ll + ts.ts[0].tv_nsec -
+                   (real.tv_sec - mono.tv_sec) * 1000000000ll -
+                   (real.tv_nsec - mono.tv_nsec);
+    ++pace_checked;
+    if (left + PACE_EARLY_NS < (int64_t)when)
+      ++pace_early;
+  }
+#endif
+  if (pace_checked >= PACE_CHECK)
+    stop_checking(pace_early > PACE_CHECK / 2 ? NET_PACE_USER
+                                              : NET_PACE_KERNEL);
+  else if (pace_npaced > PACE_CHECK_MAX)
+    stop_checking(NET_PACE_KERNEL);
+}
+
+void net_send_at(const net_packet_t *pkt, uint64_t when) {
+  unsigned char buff[NET_PACKET_SIZE];
+  net_serialise(buff, pkt);
+  ++pace_npaced;
+  if (pace == NET_PACE_KERNEL) {
+    send_buff(buff, when, true);
+  } else if (pace == NET_PACE_USER && pace_len < PACE_QUEUE &&
+             when > net_clock()) {
+    paced_t *p = &pace_queue[(pace_head + pace_len++) % PACE_QUEUE];
+    memcpy(p->buff, buff, sizeof(buff));
+    p->when = when;
+    ++pace_held;
+  } else {
+    ++pace_due;
+    send_buff(buff, 0, false);
+  }
+}
+
+void net_pace_poll() {
+  if (pace_checking)
+    check_timestamps();
+  /* Packets are queued in the order of their times. */
+  while (pace_len) {
+    paced_t *p = &pace_queue[pace_head];
+    uint64_t now = net_clock();
+    if (now < p->when)
+      break;
+    send_buff(p->buff, 0, false);
+    uint64_t late = now - p->when;
+    pace_late_sum += late;
+    if (late > pace_late_max)
+      pace_late_max = late;
+    pace_head = (pace_head + 1) % PACE_QUEUE;
+    --pace_len;
+  }
+}
+
+void net_pace_report() {
+  if (pace == NET_PACE_KERNEL && pace_npaced)
+    fprintf(stderr, "paced %u packets with SO_TXTIME\n",
+            (unsigned)pace_npaced);
+  if (pace_held)
+    fprintf(stderr, "paced %u packets in user space, sent %.1f us late on "
+                    "average and %.1f us at most\n",
+            (unsigned)pace_held, pace_late_sum / 1e3 / pace_held,
+            pace_late_max / 1e3);
+  if (pace_due)
+    fprintf(stderr, "%u paced packets were already due\n",
+            (unsigned)pace_due);
+}
+
+void net_join(uint16_t session, uint8_t player) {
+  if (!relay)
+    relay_host = sock_addr_other.sin_addr;
+  relay = true;
+  relay_session = session;
+  relay_player = player;
+  net_packet_t pkt = {.opcode = OPCODE_JOIN, .epoch = session, .input = player};
+  net_send(&pkt);
 }
@@ -18,19 +18,128 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/*
+ * The packet format. The packet struct, its wire layout, the codecs, the
+ * kernel filter of net_filter and xpong-dissect are all generated from these
+ * two lists, so a new field or opcode is added here and nowhere else.
+ *
+ * NET_FIELDS lists the fields in wire order: name, C type and bytes on the
+ * wire, big endian. NET_OPCODES lists the opcodes: name, value, what the
+ * packet is, and what its epoch and input fields carry ("" if nothing).
+ *
+ * JOIN is sent to a relay to join a session, and the relay answers with the
+ * same packet from the address the client should talk to from then on.
+ * PING, PONG and MODE probe the link and change the input delay, see
+ * netmode.h. Relays pass them on like CMD and ACK.
+ */
+#define NET_FIELDS(X)                                                          \
+  X(opcode, uint8_t, 1)                                                        \
+  X(epoch, uint16_t, 2)                                                        \
+  X(input, uint8_t, 1)
+
+#define NET_OPCODES(X)                                                         \
+  X(CMD, 0, "Command", "epoch", "input")                                       \
+  X(ACK, 1, "Acknowledgement", "epoch", "")                                    \
+  X(JOIN, 2, "Join a relay session", "session", "player")                      \
+  X(PING, 3, "Link probe", "sequence number", "")                              \
+  X(PONG, 4, "Answer to a PING", "sequence number", "")                        \
+  X(MODE, 5, "Input delay change", "first epoch", "delay")
+
+enum {
+#define NET_OPCODE_ENUM(name, value, ...) OPCODE_##name = value,
+  NET_OPCODES(NET_OPCODE_ENUM)
+#undef NET_OPCODE_ENUM
+};
+
+/* Opcodes are numbered from 0 without gaps, which network.c checks. */
+enum {
+#define NET_OPCODE_COUNT(name, ...) NET_COUNT_##name,
+  NET_OPCODES(NET_OPCODE_COUNT)
+#undef NET_OPCODE_COUNT
+  NET_NOPCODE
+};
+#define OPCODE_MAX (NET_NOPCODE - 1)
+
+/* Input of the JOIN answer of a relay that has no room for the session. */
+#define JOIN_REJECT 0xFF
+
 typedef struct net_packet {
-  /* TODO: Declare variables according to the protocol. */
-  uint8_t opcode;
-  uint16_t epoch;
-  uint8_t input;
+#define NET_FIELD_DECLARE(name, type, bytes) type name;
+  NET_FIELDS(NET_FIELD_DECLARE)
+#undef NET_FIELD_DECLARE
 } net_packet_t;
 
+/* The packet as it is on the wire: the fields back to back at their wire
+ * size, with no padding. */
+typedef struct net_wire {
+#define NET_FIELD_WIRE(name, type, bytes) uint8_t name[bytes];
+  NET_FIELDS(NET_FIELD_WIRE)
+#undef NET_FIELD_WIRE
+} net_wire_t;
+
+enum { NET_PACKET_SIZE = sizeof(net_wire_t) };
+
 void net_init(unsigned short port_self, const char *hostname_other,
               unsigned short port_other);
 void net_fini();
 void net_send(const net_packet_t *pkt);
 int net_poll(net_packet_t *pkt);
 
+/* Have the kernel drop every datagram on fd that is not a packet with a
+ * known opcode. net_init does this for its own socket. */
+void net_filter(int fd);
+
+/* Ask the relay at the peer address to join session as player. From then
+ * on net_poll drops any JOIN that is not from the relay's host for this
+ * session and player, so that no one else can move us elsewhere. */
+void net_join(uint16_t session, uint8_t player);
+
+/* CLOCK_MONOTONIC in ns, the clock of net_send_at. */
+uint64_t net_clock();
+/* When the kernel received the packet net_poll returned last, in ns of
+ * CLOCK_REALTIME, 0 if it did not say. */
+uint64_t net_rx_time();
+
+typedef enum { NET_PACE_NONE, NET_PACE_USER, NET_PACE_KERNEL } net_pace_t;
+
+/* Have net_send_at send its packets at their time rather than at once.
+ * With kernel they carry the time in SO_TXTIME, on CLOCK_MONOTONIC, for
+ * the fq qdisc to hold them until then. The first of them are checked
+ * against their transmit timestamps, and if they left early, as they do
+ * without such a qdisc, or there is no SO_TXTIME, net_pace_poll holds
+ * them instead.
+ * Returns how they are timed. */
+net_pace_t net_pace_init(bool kernel);
+/* Send pkt at when, a net_clock time, or at once if it is due. */
+void net_send_at(const net_packet_t *pkt, uint64_t when);
+/* Send the packets held that are due, and check the transmit timestamps.
+ * Call it as often as possible. */
+void net_pace_poll();
+void net_pace_report();
+
+void net_serialise(unsigned char *buff, const net_packet_t *pkt);
+void net_deserialise(net_packet_t *pkt, const unsigned char *buff);
+
+/* Encode or decode n packets, the ith at buff + i * stride. */
+void net_serialise_batch(unsigned char *buff, size_t stride,
+                         const net_packet_t *pkts, size_t n);
+void net_deserialise_batch(net_packet_t *pkts, const unsigned char *buff,
+                           size_t stride, size_t n);
+
+/* The batch codecs are built for several instruction sets and the best one
+ * the CPU supports is picked at startup. */
+const char *net_codec_name();
+
+/* Round-trip random packets and random bytes through every codec the CPU
+ * supports, falling back to the baseline codec if the selected one gets
+ * anything wrong. Returns the number of failing codecs. */
+int net_selftest();
+
+/* The name of opcode, NULL if there is no such opcode. */
+const char *net_opcode_name(uint8_t opcode);
+
 #endif
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "predict.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Counts are halved once one of them reaches this, so that the model keeps
+ * adapting to a player's habits as the match goes on. */
+static const uint16_t COUNT_LIMIT = 64;
+
+static int feature(const state_t *state, int player) {
+  const paddle_t *p = &state->paddle[player];
+  const ball_t *b = &state->ball;
+
+  /* Ball moving away from the paddle. */
+  if ((b->vel.x > 0) == (p->pos.x > 0) && b->vel.x)
+    return 0;
+
+  float dy = b->pos.y - p->pos.y;
+  if (dy > p->size.y / 4)
+    return 1;
+  if (dy < -p->size.y / 4)
+    return 3;
+  return 2;
+}
+
+static int context(const predict_t *pred, const state_t *state) {
+  return (pred->last[1] * 3 + pred->last[0]) * PREDICT_NFEATURE +
+         feature(state, pred->player);
+}
+
+void predict_init(predict_t *pred, int player) {
+  memset(pred, 0, sizeof(*pred));
+  pred->player = player;
+  pred->last[0] = pred->last[1] = CMD_NONE;
+}
+
+cmd_t predict_next(const predict_t *pred, const state_t *state) {
+  const uint16_t *count = pred->count[context(pred, state)];
+
+  /* Fall back to repeating the last input on ties. */
+  cmd_t best = pred->last[0];
+  for (cmd_t c = CMD_NONE; c <= CMD_DOWN; ++c) {
+    if (count[c] > count[best])
+      best = c;
+  }
+  return best;
+}
+
+void predict_update(predict_t *pred, const state_t *state, cmd_t guess,
+                    cmd_t actual, uint32_t depth) {
+  /* actual is the peer's byte off the network and indexes the counts, so
+     never trust it to be a command. Only the command is predicted, not
+     when in the tick it changed. */
+  actual = SIM_INPUT_CMD(actual);
+  if (actual > CMD_DOWN)
+    actual = CMD_NONE;
+  uint16_t *count = pred->count[context(pred, state)];
+  if (++count[actual] >= COUNT_LIMIT) {
+    for (size_t i = 0; i < 3; ++i)
+      count[i] /= 2;
+  }
+  pred->last[1] = pred->last[0];
+  pred->last[0] = actual;
+
+  ++pred->guesses;
+  if (guess == actual) {
+    ++pred->hits;
+    return;
+  }
+
+  /* The actual input arrived before the guess was run ahead on. */
+  if (!depth) {
+    ++pred->unused;
+    return;
+  }
+  ++pred->rollbacks;
+  pred->depth_sum += depth;
+  if (depth > pred->depth_max)
+    pred->depth_max = depth;
+  ++pred->depth_hist[depth < PREDICT_NDEPTH ? depth : PREDICT_NDEPTH - 1];
+}
+
+void predict_report(const predict_t *pred) {
+  if (!pred->guesses)
+    return;
+
+  fprintf(stderr, "player %d prediction: %u/%u correct (%.1f%%)\n",
+          pred->player, (unsigned)pred->hits, (unsigned)pred->guesses,
+          100.0 * pred->hits / pred->guesses);
+  if (pred->unused)
+    fprintf(stderr, "wrong guesses not run ahead on: %u\n",
+            (unsigned)pred->unused);
+  if (!pred->rollbacks)
+    return;
+
+  fprintf(stderr, "rollbacks: %u, depth mean %.2f max %u ticks\n",
+          (unsigned)pred->rollbacks,
+          (double)pred->depth_sum / pred->rollbacks,
+          (unsigned)pred->depth_max);
+  for (size_t i = 0; i < PREDICT_NDEPTH; ++i) {
+    if (pred->depth_hist[i])
+      fprintf(stderr, "  depth %2zu%s: %u\n", i,
+              i == PREDICT_NDEPTH - 1 ? "+" : " ",
+              (unsigned)pred->depth_hist[i]);
+  }
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include "simulate.h"
+
+#include <stdint.h>
+
+/* Contexts are the last two inputs of the player combined with where the
+ * ball is relative to the player's paddle. */
+#define PREDICT_NFEATURE 4
+#define PREDICT_NCONTEXT (3 * 3 * PREDICT_NFEATURE)
+
+/* Rollback depths are counted in ticks, the last bucket holds the rest. */
+#define PREDICT_NDEPTH 16
+
+typedef struct predict {
+  int player;
+  cmd_t last[2];
+  uint16_t count[PREDICT_NCONTEXT][3];
+
+  /* Statistics */
+  uint32_t guesses, hits, unused;
+  uint32_t rollbacks, depth_max;
+  uint64_t depth_sum;
+  uint32_t depth_hist[PREDICT_NDEPTH];
+} predict_t;
+
+void predict_init(predict_t *pred, int player);
+
+/* Guess the player's input for the epoch that simulates from state. */
+cmd_t predict_next(const predict_t *pred, const state_t *state);
+
+/* Learn the actual input of the epoch that simulates from state. guess is
+ * what predict_next returned and depth is how many ticks we would have run
+ * ahead on the guess before the actual input arrived. A wrong guess is a
+ * rollback only at a depth of a tick or more. */
+void predict_update(predict_t *pred, const state_t *state, cmd_t guess,
+                    cmd_t actual, uint32_t depth);
+
+void predict_report(const predict_t *pred);
+
+#endif
@@ -0,0 +1,1362 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xpong-relay forwards XPong packets between the two players of each
+ * session. Clients join a session with a JOIN packet, after which their
+ * CMD and ACK packets are passed on to the other player unchanged. The
+ * relay follows the protocol passing through it and simulates every
+ * confirmed epoch of each session.
+ *
+ * Sessions are spread over worker threads. Each worker owns a socket on
+ * its own port, and answers JOIN packets from that socket so that clients
+ * talk to it directly. Sessions can move between workers between two
+ * ticks: the session is serialised, handed to the other worker, and that
+ * worker re-joins both clients to its own port.
+ *
+ * Every session has its own tick, one interval after the last, and a
+ * worker steps the sessions that are due earliest deadline first.
+ *
+ * A running relay can be replaced by a new one without dropping sessions,
+ * see take_over.
+ *
+ * Two relays can be connected by a trunk. When the other player of a
+ * session is not joined locally, its packets are queued for the trunk,
+ * and every tick the queued records of all sessions go out in as few
+ * datagrams as possible. The far relay demultiplexes them by session.
+ */
+
+#define _GNU_SOURCE
+
+#include "network.h"
+#include "session.h"
+#include "simulate.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static const uint32_t TICK_INTERVAL = 10;
+static const uint32_t STATS_INTERVAL = 5000;
+static const uint32_t REBALANCE_INTERVAL = 1000;
+/* A seated player is only replaced by a JOIN from another address once it
+ * has been silent for this long. */
+static const uint64_t REJOIN_NS = 1000000000;
+/* A session no player has been heard from for this long has ended. */
+static const uint64_t IDLE_NS = 10000000000;
+
+#define TICK_NS (TICK_INTERVAL * 1000000ull)
+
+/* Session lateness histogram, bucket i counts lateness below 2^i us. */
+#define NLATE 24
+
+/* Admission looks at the 99th percentile of the last ADMIT_WINDOW ticks. */
+#define ADMIT_WINDOW 100
+/* Until a worker has stepped any sessions, a new one is taken to cost
+ * this fraction of the budget. */
+#define ADMIT_COLD_SESSIONS 64
+
+#define NSESSION (UINT16_MAX + 1)
+#define MAX_WORKER 64
+
+/* Trunk datagram: opcode, record count, then records of TRUNK_RECORD bytes:
+ * session (2), player the packet is from (1), the packet itself (4). */
+#define OPCODE_TRUNK 0x20
+#define TRUNK_HEADER 3
+#define TRUNK_RECORD (3 + NET_PACKET_SIZE)
+#define TRUNK_MTU 1472
+
+/* Client address to session and player, open addressing. */
+#define NSLOT_BITS 16
+#define NSLOT (1 << NSLOT_BITS)
+typedef struct slot {
+  uint64_t key;
+  uint16_t session;
+  uint8_t player;
+} slot_t;
+
+/* Owner of a session: the index of a worker, or one of these. */
+#define OWNER_NONE -1
+#define OWNER_MOVING -2
+
+enum { MAIL_JOIN, MAIL_SESSION };
+
+typedef struct mail {
+  struct mail *next;
+  int type;
+  /* MAIL_JOIN, create the session if the sender claimed it for us. */
+  bool create;
+  struct sockaddr_in from;
+  net_packet_t pkt;
+  /* MAIL_SESSION */
+  uint64_t freeze_ns;
+  uint8_t blob[SESSION_BLOB_SIZE];
+} mail_t;
+
+typedef struct worker {
+  int id;
+  pthread_t thread;
+  int sock, trunk_sock;
+  struct sockaddr_in trunk_peer;
+  uint8_t trunk_buff[TRUNK_MTU];
+  size_t trunk_len;
+
+  /* Mail from other workers, the pipe wakes us up. */
+  int wake[2];
+  pthread_mutex_t lock;
+  mail_t *mail, **mail_tail;
+
+  /* Owned sessions in no particular order, and as a binary heap on their
+   * deadlines. */
+  session_t **owned;
+  session_hot_t **heap;
+  size_t nowned, capacity;
+
+  /* Sessions due this round, when they are stepped as a batch. */
+  session_hot_t **due_hot;
+  session_t **due;
+  size_t ndue;
+  sim_soa_t *soa;
+  /* nowned, for other workers to read. */
+  atomic_size_t load;
+
+  slot_t slots[NSLOT];
+
+  struct {
+    uint64_t client_in, client_out;
+    uint64_t trunk_out, trunk_in, records_out, records_in;
+    uint64_t epochs;
+    uint32_t moved_in, moved_out, ended;
+    uint64_t handover_max_ns;
+    uint32_t admitted, rejected;
+    uint32_t late[NLATE];
+  } stats;
+
+  /* Time spent stepping sessions and their worst lateness since the last
+   * worker tick. */
+  uint64_t busy_ns;
+  uint32_t max_late_us;
+
+  /* How long ticks took to process and how late they started, in us. */
+  uint32_t proc_us[ADMIT_WINDOW], late_us[ADMIT_WINDOW];
+  size_t nsample;
+  atomic_uint p99_proc_us, p99_late_us;
+  /* Time spent stepping in this window, and stats.epochs when it began. */
+  uint64_t window_busy_ns, window_epochs;
+  /* Time spent per epoch stepped in the last window, 0 if none were. */
+  atomic_uint epoch_ns;
+  /* The expected cost of the sessions admitted lately, until the p99
+   * shows them, and the part of it reserved before the current window,
+   * which the next p99 covers. */
+  atomic_uint reserved_us;
+  uint32_t reserved_old_us;
+} worker_t;
+
+static worker_t *workers;
+static int nworker = 1;
+/* A worker takes new sessions while its p99 tick processing time plus
+ * lateness stays below this. */
+static uint32_t budget_us = 5000;
+/* Step due sessions in deadline order, or in list order to compare. */
+static bool edf = true;
+/* Step the sessions due in a round together, with the SoA kernel. */
+static bool batch = false;
+static bool trunked;
+
+/* Set when handing over to a new relay process. */
+static atomic_bool freezing;
+static pthread_barrier_t freeze_barrier;
+
+/* Only the owning worker touches a session. */
+static _Atomic int8_t owner[NSESSION];
+static session_t *sessions[NSESSION];
+static session_hot_t hot[NSESSION];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t tick() { return now_ns() / 1000000; }
+
+static void die(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+static int bind_udp(unsigned short port) {
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0)
+    die("socket");
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(port);
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    die("bind");
+  return s;
+}
+
+static void resolve(struct sockaddr_in *addr, const char *host_port) {
+  char host[256];
+  const char *colon = strrchr(host_port, ':');
+  if (!colon || colon - host_port >= (int)sizeof(host)) {
+    fprintf(stderr, "bad address %s, expected host:port\n", host_port);
+    exit(1);
+  }
+  memcpy(host, host_port, colon - host_port);
+  host[colon - host_port] = '\0';
+
+  *addr = (struct sockaddr_in){0};
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(atoi(colon + 1));
+  if (inet_aton(host, &addr->sin_addr) == 0) {
+    struct hostent *h = gethostbyname(host);
+    if (h == NULL || h->h_addr_list[0] == NULL) {
+      fprintf(stderr, "cannot resolve %s\n", host);
+      exit(1);
+    }
+    addr->sin_addr = *(struct in_addr *)h->h_addr_list[0];
+  }
+}
+
+static uint64_t addr_key(const struct sockaddr_in *addr) {
+  /* Never 0, which marks an empty slot. */
+  return (uint64_t)ntohl(addr->sin_addr.s_addr) << 16 |
+         ntohs(addr->sin_port) | (uint64_t)1 << 48;
+}
+
+static size_t slot_home(uint64_t key) {
+  return (key * 0x9e3779b97f4a7c15) >> (64 - NSLOT_BITS);
+}
+
+static slot_t *find_slot(worker_t *w, uint64_t key) {
+  size_t i = slot_home(key);
+  for (size_t n = 0; n < NSLOT; ++n, i = (i + 1) % NSLOT) {
+    if (w->slots[i].key == key || !w->slots[i].key)
+      return &w->slots[i];
+  }
+  return NULL;
+}
+
+static void post(worker_t *w, mail_t *m) {
+  m->next = NULL;
+  pthread_mutex_lock(&w->lock);
+  *w->mail_tail = m;
+  w->mail_tail = &m->next;
+  pthread_mutex_unlock(&w->lock);
+  write(w->wake[1], "", 1);
+}
+
+static void send_join(worker_t *w, const session_t *s, int player) {
+  net_packet_t pkt = {
+      .opcode = OPCODE_JOIN, .epoch = s->id, .input = player};
+  unsigned char buff[NET_PACKET_SIZE];
+  net_serialise(buff, &pkt);
+  sendto(w->sock, buff, sizeof(buff), 0,
+         (const struct sockaddr *)&s->addr[player], sizeof(s->addr[player]));
+}
+
+static void add_slot(worker_t *w, const session_t *s, int player) {
+  slot_t *slot = find_slot(w, addr_key(&s->addr[player]));
+  if (slot)
+    *slot = (slot_t){addr_key(&s->addr[player]), s->id, player};
+}
+
+/* Empty the slot of player of s, moving back the slots after it that
+ * probed past it, so that no lookup stops short at the hole. */
+static void remove_slot(worker_t *w, const session_t *s, int player) {
+  uint64_t key = addr_key(&s->addr[player]);
+  slot_t *slot = find_slot(w, key);
+  if (!slot || slot->key != key || slot->session != s->id ||
+      slot->player != player)
+    return;
+  size_t i = slot - w->slots;
+  for (size_t j = (i + 1) % NSLOT; w->slots[j].key; j = (j + 1) % NSLOT) {
+    if ((j - slot_home(w->slots[j].key)) % NSLOT >= (j - i) % NSLOT) {
+      w->slots[i] = w->slots[j];
+      i = j;
+    }
+  }
+  w->slots[i].key = 0;
+}
+
+static void heap_set(worker_t *w, size_t i, session_hot_t *h) {
+  w->heap[i] = h;
+  h->heap = i;
+}
+
+static void sift_up(worker_t *w, size_t i) {
+  session_hot_t *h = w->heap[i];
+  while (i && w->heap[(i - 1) / 2]->deadline_ns > h->deadline_ns) {
+    heap_set(w, i, w->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_set(w, i, h);
+}
+
+static void sift_down(worker_t *w, size_t i) {
+  session_hot_t *h = w->heap[i];
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= w->nowned)
+      break;
+    if (c + 1 < w->nowned &&
+        w->heap[c + 1]->deadline_ns < w->heap[c]->deadline_ns)
+      ++c;
+    if (w->heap[c]->deadline_ns >= h->deadline_ns)
+      break;
+    heap_set(w, i, w->heap[c]);
+    i = c;
+  }
+  heap_set(w, i, h);
+}
+
+static void install(worker_t *w, session_t *s) {
+  if (w->nowned == w->capacity) {
+    w->capacity = w->capacity ? 2 * w->capacity : 64;
+    w->owned = realloc(w->owned, w->capacity * sizeof(*w->owned));
+    w->heap = realloc(w->heap, w->capacity * sizeof(*w->heap));
+    w->due_hot = realloc(w->due_hot, w->capacity * sizeof(*w->due_hot));
+    w->due = realloc(w->due, w->capacity * sizeof(*w->due));
+    if (!w->owned || !w->heap || !w->due_hot || !w->due)
+      die("realloc");
+  }
+  s->index = w->nowned;
+  w->owned[w->nowned] = s;
+  s->hot->deadline_ns = now_ns() + TICK_NS;
+  w->heap[w->nowned] = s->hot;
+  sift_up(w, w->nowned++);
+  atomic_store(&w->load, w->nowned);
+
+  for (int i = 0; i < NPLAYER; ++i) {
+    if (s->joined[i])
+      add_slot(w, s, i);
+    s->heard_ns[i] = now_ns();
+  }
+  sessions[s->id] = s;
+  atomic_store(&owner[s->id], w->id);
+}
+
+static void uninstall(worker_t *w, session_t *s) {
+  atomic_store(&owner[s->id], OWNER_MOVING);
+  w->owned[s->index] = w->owned[--w->nowned];
+  w->owned[s->index]->index = s->index;
+
+  size_t i = s->hot->heap;
+  if (i != w->nowned) {
+    heap_set(w, i, w->heap[w->nowned]);
+    sift_up(w, i);
+    sift_down(w, w->heap[i]->heap);
+  }
+  atomic_store(&w->load, w->nowned);
+
+  for (int i = 0; i < NPLAYER; ++i) {
+    if (s->joined[i])
+      remove_slot(w, s, i);
+  }
+}
+
+/* Seat from as player of s. A seated player keeps its seat against JOINs
+ * from other addresses until it has gone silent, as after a NAT rebinding,
+ * and then its old address no longer reaches the session. */
+static void join(worker_t *w, session_t *s, const struct sockaddr_in *from,
+                 int player) {
+  uint64_t now = now_ns();
+  if (s->joined[player] && addr_key(&s->addr[player]) != addr_key(from)) {
+    if (now - s->heard_ns[player] < REJOIN_NS)
+      return;
+    remove_slot(w, s, player);
+  }
+  s->heard_ns[player] = now;
+  s->joined[player] = true;
+  s->addr[player] = *from;
+  add_slot(w, s, player);
+  send_join(w, s, player);
+}
+
+/* The p99 tick time plus lateness of worker i, and what the sessions not
+ * yet in it are expected to add. */
+static uint32_t worker_us(int i) {
+  return atomic_load(&workers[i].p99_proc_us) +
+         atomic_load(&workers[i].p99_late_us) +
+         atomic_load(&workers[i].reserved_us);
+}
+
+static bool headroom(int i) { return worker_us(i) < budget_us; }
+
+/* Reserve what a new session on worker i is expected to cost until it
+ * shows in the p99, so that a burst of JOINs between two p99s cannot be
+ * admitted all at once. A session steps an epoch every tick, so it costs
+ * what the worker spent per epoch lately, or a fixed share of the budget
+ * if the worker has not stepped any. */
+static void reserve(int i) {
+  uint64_t ns = atomic_load(&workers[i].epoch_ns);
+  if (!ns)
+    ns = budget_us * 1000ull / ADMIT_COLD_SESSIONS;
+  atomic_fetch_add(&workers[i].reserved_us, (ns + 999) / 1000);
+}
+
+/* Pick a worker for a new session, or -1 if none can take it without
+ * making the sessions it has late. */
+static int admit(uint16_t session) {
+  /* Both relays of a trunk must place a session on the same worker. */
+  if (trunked)
+    return headroom(session % nworker) ? session % nworker : -1;
+
+  int best = -1;
+  uint32_t best_us = 0;
+  for (int i = 0; i < nworker; ++i) {
+    uint32_t us = worker_us(i);
+    if (headroom(i) && (best < 0 || us < best_us ||
+                        (us == best_us && atomic_load(&workers[i].load) <
+                                              atomic_load(&workers[best].load)))) {
+      best = i;
+      best_us = us;
+    }
+  }
+  return best;
+}
+
+static void reject(worker_t *w, const struct sockaddr_in *from,
+                   const net_packet_t *pkt) {
+  net_packet_t reply = *pkt;
+  reply.input = JOIN_REJECT;
+  unsigned char buff[NET_PACKET_SIZE];
+  net_serialise(buff, &reply);
+  sendto(w->sock, buff, sizeof(buff), 0, (const struct sockaddr *)from,
+         sizeof(*from));
+  ++w->stats.rejected;
+}
+
+/* A JOIN goes to the worker owning the session, new sessions are admitted
+ * to a worker here. Clients repeat JOIN every tick until answered, so it
+ * is fine to drop one while its session is moving. */
+static void route_join(worker_t *w, const struct sockaddr_in *from,
+                       const net_packet_t *pkt) {
+  if (pkt->input >= NPLAYER || atomic_load(&freezing))
+    return;
+
+  int8_t o = atomic_load(&owner[pkt->epoch]);
+  if (o == w->id) {
+    join(w, sessions[pkt->epoch], from, pkt->input);
+    return;
+  }
+
+  int to = o;
+  bool create = false;
+  if (o == OWNER_NONE) {
+    to = admit(pkt->epoch);
+    if (to < 0) {
+      reject(w, from, pkt);
+      return;
+    }
+    int8_t none = OWNER_NONE;
+    if (!atomic_compare_exchange_strong(&owner[pkt->epoch], &none,
+                                        OWNER_MOVING))
+      return;
+    create = true;
+    reserve(to);
+    ++w->stats.admitted;
+  } else if (o < 0) {
+    return;
+  }
+
+  if (to == w->id) {
+    session_t *s = malloc(sizeof(*s));
+    if (!s)
+      die("malloc");
+    session_init(s, hot, pkt->epoch);
+    install(w, s);
+    join(w, s, from, pkt->input);
+    return;
+  }
+
+  mail_t *m = malloc(sizeof(*m));
+  if (!m)
+    die("malloc");
+  m->type = MAIL_JOIN;
+  m->create = create;
+  m->from = *from;
+  m->pkt = *pkt;
+  post(&workers[to], m);
+}
+
+/* Hand a session over to another worker. */
+static void migrate(worker_t *w, session_t *s, int to) {
+  mail_t *m = malloc(sizeof(*m));
+  if (!m)
+    die("malloc");
+  m->type = MAIL_SESSION;
+  m->freeze_ns = now_ns();
+  uninstall(w, s);
+  session_serialise(m->blob, s);
+  free(s);
+  ++w->stats.moved_out;
+  post(&workers[to], m);
+}
+
+static void adopt(worker_t *w, const mail_t *m) {
+  session_t *s = malloc(sizeof(*s));
+  if (!s)
+    die("malloc");
+  if (session_deserialise(s, hot, m->blob) < 0) {
+    fprintf(stderr, "relay worker %d: bad session blob\n", w->id);
+    /* Let the next JOIN start the session afresh rather than wait for a
+       move that is not coming. */
+    atomic_store(&owner[s->id], OWNER_NONE);
+    free(s);
+    return;
+  }
+  install(w, s);
+  /* Move the clients over to our port. */
+  for (int i = 0; i < NPLAYER; ++i) {
+    if (s->joined[i])
+      send_join(w, s, i);
+  }
+
+  uint64_t handover = now_ns() - m->freeze_ns;
+  if (handover > w->stats.handover_max_ns)
+    w->stats.handover_max_ns = handover;
+  if (handover > TICK_INTERVAL * 1000000ull)
+    fprintf(stderr, "relay worker %d: session %u handover took %llu us\n",
+            w->id, (unsigned)s->id, (unsigned long long)handover / 1000);
+  ++w->stats.moved_in;
+}
+
+static void mail_poll(worker_t *w) {
+  char drain[64];
+  while (read(w->wake[0], drain, sizeof(drain)) > 0)
+    ;
+
+  pthread_mutex_lock(&w->lock);
+  mail_t *m = w->mail;
+  w->mail = NULL;
+  w->mail_tail = &w->mail;
+  pthread_mutex_unlock(&w->lock);
+
+  while (m) {
+    mail_t *next = m->next;
+    if (m->type == MAIL_JOIN) {
+      if (m->create) {
+        session_t *s = malloc(sizeof(*s));
+        if (!s)
+          die("malloc");
+        session_init(s, hot, m->pkt.epoch);
+        install(w, s);
+      }
+      route_join(w, &m->from, &m->pkt);
+    } else {
+      adopt(w, m);
+    }
+    free(m);
+    m = next;
+  }
+}
+
+static void trunk_flush(worker_t *w) {
+  if (w->trunk_len == TRUNK_HEADER)
+    return;
+
+  size_t n = (w->trunk_len - TRUNK_HEADER) / TRUNK_RECORD;
+  w->trunk_buff[0] = OPCODE_TRUNK;
+  w->trunk_buff[1] = n >> 8;
+  w->trunk_buff[2] = n & 0xFF;
+  sendto(w->trunk_sock, w->trunk_buff, w->trunk_len, 0,
+         (struct sockaddr *)&w->trunk_peer, sizeof(w->trunk_peer));
+  ++w->stats.trunk_out;
+  w->stats.records_out += n;
+  w->trunk_len = TRUNK_HEADER;
+}
+
+static void trunk_queue(worker_t *w, uint16_t session, uint8_t player,
+                        const unsigned char *pkt) {
+  if (w->trunk_len + TRUNK_RECORD > sizeof(w->trunk_buff))
+    trunk_flush(w);
+
+  uint8_t *rec = w->trunk_buff + w->trunk_len;
+  rec[0] = session >> 8;
+  rec[1] = session & 0xFF;
+  rec[2] = player;
+  memcpy(rec + 3, pkt, NET_PACKET_SIZE);
+  w->trunk_len += TRUNK_RECORD;
+}
+
+/* Pass a packet from player of session on to the other player. */
+static void forward(worker_t *w, session_t *s, uint8_t player,
+                    const unsigned char *pkt) {
+  int other = !player;
+  if (s->joined[other]) {
+    sendto(w->sock, pkt, NET_PACKET_SIZE, 0,
+           (struct sockaddr *)&s->addr[other], sizeof(s->addr[other]));
+    ++w->stats.client_out;
+  } else if (trunked) {
+    trunk_queue(w, s->id, player, pkt);
+  }
+}
+
+static void client_poll(worker_t *w) {
+  /* Close enough for when a player was last heard from. */
+  uint64_t now = now_ns();
+  unsigned char buff[NET_PACKET_SIZE];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  ssize_t len;
+  while ((len = recvfrom(w->sock, buff, sizeof(buff), MSG_DONTWAIT,
+                         (struct sockaddr *)&from, &from_len)) >= 0) {
+    from_len = sizeof(from);
+    if (len != NET_PACKET_SIZE)
+      continue;
+    ++w->stats.client_in;
+
+    net_packet_t pkt;
+    net_deserialise(&pkt, buff);
+    if (pkt.opcode == OPCODE_JOIN) {
+      route_join(w, &from, &pkt);
+      continue;
+    }
+
+    /* The session may have moved away, or the address since joined as
+     * someone else. */
+    slot_t *slot = find_slot(w, addr_key(&from));
+    if (!slot || !slot->key || atomic_load(&owner[slot->session]) != w->id)
+      continue;
+    session_t *s = sessions[slot->session];
+    if (addr_key(&s->addr[slot->player]) != slot->key)
+      continue;
+
+    s->heard_ns[slot->player] = now;
+    session_observe(s->hot, slot->player, &pkt);
+    forward(w, s, slot->player, buff);
+  }
+}
+
+static void trunk_poll(worker_t *w) {
+  uint64_t now = now_ns();
+  uint8_t buff[TRUNK_MTU];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  ssize_t len;
+  while ((len = recvfrom(w->trunk_sock, buff, sizeof(buff), MSG_DONTWAIT,
+                         (struct sockaddr *)&from, &from_len)) >= 0) {
+    from_len = sizeof(from);
+    /* Only the far relay speaks for the players on its side. */
+    if (addr_key(&from) != addr_key(&w->trunk_peer))
+      continue;
+    if (len < TRUNK_HEADER || buff[0] != OPCODE_TRUNK)
+      continue;
+    size_t n = (size_t)buff[1] << 8 | buff[2];
+    if (len != TRUNK_HEADER + (ssize_t)(n * TRUNK_RECORD))
+      continue;
+    ++w->stats.trunk_in;
+    w->stats.records_in += n;
+
+    net_packet_t pkts[(TRUNK_MTU - TRUNK_HEADER) / TRUNK_RECORD];
+    net_deserialise_batch(pkts, buff + TRUNK_HEADER + 3, TRUNK_RECORD, n);
+    const net_packet_t *pkt = pkts;
+    for (const uint8_t *rec = buff + TRUNK_HEADER; n;
+         --n, rec += TRUNK_RECORD, ++pkt) {
+      uint16_t session = rec[0] << 8 | rec[1];
+      uint8_t player = rec[2];
+      if (player >= NPLAYER || atomic_load(&owner[session]) != w->id)
+        continue;
+
+      /* Never bounce a record back into the trunk. */
+      session_t *s = sessions[session];
+      if (!s->joined[!player])
+        continue;
+
+      s->heard_ns[player] = now;
+      session_observe(s->hot, player, pkt);
+      forward(w, s, player, rec + 3);
+    }
+  }
+}
+
+/* End the sessions no player has been heard from for IDLE_NS, so that
+ * their ids can start new matches and their room goes to new sessions. */
+static void reap(worker_t *w) {
+  uint64_t now = now_ns();
+  for (size_t i = 0; i < w->nowned;) {
+    session_t *s = w->owned[i];
+    bool idle = true;
+    for (int p = 0; p < NPLAYER; ++p) {
+      if (now - s->heard_ns[p] < IDLE_NS)
+        idle = false;
+    }
+    if (!idle) {
+      ++i;
+      continue;
+    }
+    /* The last session takes its place in the list. */
+    uninstall(w, s);
+    sessions[s->id] = NULL;
+    atomic_store(&owner[s->id], OWNER_NONE);
+    free(s);
+    ++w->stats.ended;
+  }
+}
+
+/* Move a session to the least loaded worker if we have too many. Sessions
+ * with a player on the far end of the trunk stay where the far relay
+ * expects them. */
+static void rebalance(worker_t *w) {
+  int to = w->id;
+  for (int i = 0; i < nworker; ++i) {
+    if (atomic_load(&workers[i].load) < atomic_load(&workers[to].load))
+      to = i;
+  }
+  if (w->nowned <= atomic_load(&workers[to].load) + 1)
+    return;
+
+  for (size_t i = w->nowned; i-- > 0;) {
+    session_t *s = w->owned[i];
+    if (s->joined[0] && s->joined[1]) {
+      migrate(w, s, to);
+      return;
+    }
+  }
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint32_t p99(const uint32_t *samples, size_t n) {
+  uint32_t sorted[ADMIT_WINDOW];
+  memcpy(sorted, samples, n * sizeof(*samples));
+  qsort(sorted, n, sizeof(*sorted), compare_u32);
+  return sorted[(n * 99 + 99) / 100 - 1];
+}
+
+/* Sample the worker's load over the last worker tick. */
+static void record_tick(worker_t *w) {
+  size_t i = w->nsample++ % ADMIT_WINDOW;
+  w->proc_us[i] = w->busy_ns / 1000;
+  w->window_busy_ns += w->busy_ns;
+  w->late_us[i] = w->max_late_us;
+  w->busy_ns = 0;
+  w->max_late_us = 0;
+  if (w->nsample % ADMIT_WINDOW == 0) {
+    atomic_store(&w->p99_proc_us, p99(w->proc_us, ADMIT_WINDOW));
+    atomic_store(&w->p99_late_us, p99(w->late_us, ADMIT_WINDOW));
+    atomic_store(&w->epoch_ns,
+                 w->stats.epochs > w->window_epochs
+                     ? w->window_busy_ns / (w->stats.epochs - w->window_epochs)
+                     : 0);
+    w->window_busy_ns = 0;
+    w->window_epochs = w->stats.epochs;
+    /* Sessions admitted before the window started are in the p99 now. */
+    w->reserved_old_us =
+        atomic_fetch_sub(&w->reserved_us, w->reserved_old_us) -
+        w->reserved_old_us;
+  }
+}
+
+static void tick_session(worker_t *w, session_hot_t *h) {
+  uint64_t now = now_ns();
+  uint32_t late_us = (now - h->deadline_ns) / 1000;
+  if (late_us > w->max_late_us)
+    w->max_late_us = late_us;
+  int b = late_us ? 32 - __builtin_clz(late_us) : 0;
+  ++w->stats.late[b < NLATE ? b : NLATE - 1];
+
+  session_t *s = sessions[h->id];
+  if (batch) {
+    w->due_hot[w->ndue] = h;
+    w->due[w->ndue++] = s;
+  } else {
+    w->stats.epochs += session_step(h, s);
+  }
+
+  /* Keep the phase, skipping ticks we are too late for. */
+  do
+    h->deadline_ns += TICK_NS;
+  while (h->deadline_ns <= now);
+  sift_down(w, h->heap);
+}
+
+/* Step the sessions whose tick is due. */
+static void run_due(worker_t *w) {
+  uint64_t start = now_ns();
+  if (edf) {
+    while (w->nowned && w->heap[0]->deadline_ns <= now_ns())
+      tick_session(w, w->heap[0]);
+  } else {
+    for (size_t i = 0; i < w->nowned; ++i) {
+      if (w->owned[i]->hot->deadline_ns <= now_ns())
+        tick_session(w, w->owned[i]->hot);
+    }
+  }
+  if (w->ndue) {
+    w->stats.epochs += session_step_batch(w->due_hot, w->due, w->ndue,
+                                          w->soa);
+    w->ndue = 0;
+  }
+  w->busy_ns += now_ns() - start;
+}
+
+static void print_stats(worker_t *w) {
+  fprintf(stderr,
+          "relay worker %d: %zu sessions, %llu epochs, "
+          "client in %llu out %llu, "
+          "trunk out %llu datagrams (%llu records) "
+          "in %llu datagrams (%llu records), "
+          "moved in %u out %u, handover max %llu us, "
+          "p99 tick %u us late %u us, admitted %u rejected %u ended %u\n",
+          w->id, w->nowned, (unsigned long long)w->stats.epochs,
+          (unsigned long long)w->stats.client_in,
+          (unsigned long long)w->stats.client_out,
+          (unsigned long long)w->stats.trunk_out,
+          (unsigned long long)w->stats.records_out,
+          (unsigned long long)w->stats.trunk_in,
+          (unsigned long long)w->stats.records_in, (unsigned)w->stats.moved_in,
+          (unsigned)w->stats.moved_out,
+          (unsigned long long)w->stats.handover_max_ns / 1000,
+          atomic_load(&w->p99_proc_us), atomic_load(&w->p99_late_us),
+          (unsigned)w->stats.admitted, (unsigned)w->stats.rejected,
+          (unsigned)w->stats.ended);
+
+  fprintf(stderr, "relay worker %d lateness:", w->id);
+  for (int i = 0; i < NLATE; ++i) {
+    if (w->stats.late[i])
+      fprintf(stderr, " <%uus %u", 1u << i, (unsigned)w->stats.late[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+static void *worker_run(void *arg) {
+  worker_t *w = arg;
+  struct pollfd fds[3] = {{.fd = w->wake[0], .events = POLLIN},
+                          {.fd = w->sock, .events = POLLIN},
+                          {.fd = w->trunk_sock, .events = POLLIN}};
+  uint64_t next_tick = now_ns() + TICK_NS;
+  uint32_t next_stats = tick() + STATS_INTERVAL;
+  uint32_t next_rebalance = tick() + REBALANCE_INTERVAL;
+  for (;;) {
+    uint64_t wake = next_tick;
+    if (w->nowned && w->heap[0]->deadline_ns < wake)
+      wake = w->heap[0]->deadline_ns;
+    uint64_t now = now_ns();
+    uint64_t timeout = wake > now ? wake - now : 0;
+    struct timespec ts = {timeout / 1000000000, timeout % 1000000000};
+    if (ppoll(fds, trunked ? 3 : 2, &ts, NULL) < 0 && errno != EINTR)
+      die("ppoll");
+
+    mail_poll(w);
+    client_poll(w);
+    if (trunked)
+      trunk_poll(w);
+
+    if (atomic_load(&freezing)) {
+      for (size_t i = 0; i < w->nowned; ++i)
+        session_step(w->owned[i]->hot, w->owned[i]);
+      trunk_flush(w);
+      /* Once every worker has stopped posting, take in what is left. */
+      pthread_barrier_wait(&freeze_barrier);
+      mail_poll(w);
+      return NULL;
+    }
+
+    run_due(w);
+
+    now = now_ns();
+    if (now < next_tick)
+      continue;
+
+    /* Sessions only move here, after their due epochs have been
+     * simulated. */
+    trunk_flush(w);
+    record_tick(w);
+
+    next_tick += TICK_NS;
+    if (now >= next_tick)
+      next_tick = now + TICK_NS;
+    uint32_t ms = now / 1000000;
+    if ((int32_t)(ms - next_rebalance) >= 0) {
+      reap(w);
+      if (nworker > 1)
+        rebalance(w);
+      next_rebalance = ms + REBALANCE_INTERVAL;
+    }
+    if ((int32_t)(ms - next_stats) >= 0) {
+      print_stats(w);
+      next_stats = ms + STATS_INTERVAL;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Upgrades. A relay started with -u path listens for its successor on a
+ * Unix socket at path. A new relay started with the same -u connects to
+ * it, and the old relay freezes its workers, passes its UDP sockets over
+ * with SCM_RIGHTS, followed by its serialised sessions, and exits. Clients
+ * keep talking to the same sockets, and packets arriving meanwhile queue
+ * up in them until the new relay's workers start.
+ */
+
+#define UPGRADE_MAGIC 0x58505550 /* "XPUP" */
+#define UPGRADE_HELLO 12
+#define UPGRADE_HEADER 16
+
+static void put32(uint8_t *b, uint32_t v) {
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v & 0xFF;
+}
+
+static uint32_t get32(const uint8_t *b) {
+  return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 |
+         b[3];
+}
+
+static int write_all(int fd, const void *buff, size_t len) {
+  for (const char *b = buff; len;) {
+    ssize_t n = write(fd, b, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    b += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buff, size_t len) {
+  for (char *b = buff; len;) {
+    ssize_t n = read(fd, b, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    b += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static struct sockaddr_un unix_addr(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "upgrade socket path too long\n");
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+static void hand_over(int c) {
+  uint64_t freeze_ns = now_ns();
+  atomic_store(&freezing, true);
+  for (int i = 0; i < nworker; ++i)
+    write(workers[i].wake[1], "", 1);
+  for (int i = 0; i < nworker; ++i)
+    pthread_join(workers[i].thread, NULL);
+
+  size_t nsession = 0;
+  int fds[2 * MAX_WORKER], nfd = 0;
+  for (int i = 0; i < nworker; ++i) {
+    nsession += workers[i].nowned;
+    fds[nfd++] = workers[i].sock;
+    if (trunked)
+      fds[nfd++] = workers[i].trunk_sock;
+  }
+
+  uint8_t header[UPGRADE_HEADER];
+  put32(header, UPGRADE_MAGIC);
+  put32(header + 4, nsession);
+  put32(header + 8, freeze_ns >> 32);
+  put32(header + 12, freeze_ns & 0xFFFFFFFF);
+
+  union {
+    struct cmsghdr hdr;
+    char buff[CMSG_SPACE(sizeof(fds))];
+  } control = {0};
+  struct iovec iov = {.iov_base = header, .iov_len = sizeof(header)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buff,
+                       .msg_controllen = CMSG_SPACE(nfd * sizeof(int))};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfd * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfd * sizeof(int));
+  if (sendmsg(c, &msg, 0) < 0)
+    die("sendmsg");
+
+  /* Each session goes with the index of its worker. */
+  size_t len = nsession * (1 + SESSION_BLOB_SIZE);
+  uint8_t *buff = malloc(len ? len : 1), *b = buff;
+  if (!buff)
+    die("malloc");
+  for (int i = 0; i < nworker; ++i) {
+    for (size_t j = 0; j < workers[i].nowned; ++j) {
+      *b++ = i;
+      session_serialise(b, workers[i].owned[j]);
+      b += SESSION_BLOB_SIZE;
+    }
+  }
+  if (write_all(c, buff, len) < 0)
+    die("write");
+  fprintf(stderr, "relay: handed %zu sessions over to the new relay\n",
+          nsession);
+}
+
+/* Wait for a new relay to take over, then exit. */
+static void serve_upgrade(const char *path) {
+  struct sockaddr_un addr = unix_addr(path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    die("socket");
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 1) < 0)
+    die("upgrade socket");
+
+  for (;;) {
+    int c = accept(listener, NULL, NULL);
+    if (c < 0) {
+      if (errno == EINTR)
+        continue;
+      die("accept");
+    }
+
+    uint8_t hello[UPGRADE_HELLO];
+    if (read_all(c, hello, sizeof(hello)) < 0 ||
+        get32(hello) != UPGRADE_MAGIC || get32(hello + 4) != nworker ||
+        get32(hello + 8) != trunked) {
+      fprintf(stderr, "relay: refusing upgrade from a relay with another "
+                      "configuration\n");
+      close(c);
+      continue;
+    }
+
+    hand_over(c);
+    close(c);
+    close(listener);
+    exit(0);
+  }
+}
+
+/* Take the sockets and sessions of the relay listening at path, if there
+ * is one. Returns the time it froze at, or 0. */
+static uint64_t take_over(const char *path) {
+  struct sockaddr_un addr = unix_addr(path);
+  int c = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (c < 0)
+    die("socket");
+  if (connect(c, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(c);
+    return 0;
+  }
+
+  uint8_t hello[UPGRADE_HELLO];
+  put32(hello, UPGRADE_MAGIC);
+  put32(hello + 4, nworker);
+  put32(hello + 8, trunked);
+  if (write_all(c, hello, sizeof(hello)) < 0)
+    die("write");
+
+  int fds[2 * MAX_WORKER];
+  int nfd = nworker * (trunked ? 2 : 1);
+  uint8_t header[UPGRADE_HEADER];
+  union {
+    struct cmsghdr hdr;
+    char buff[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct iovec iov = {.iov_base = header, .iov_len = sizeof(header)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buff,
+                       .msg_controllen = sizeof(control.buff)};
+  ssize_t n;
+  while ((n = recvmsg(c, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(header) || get32(header) != UPGRADE_MAGIC || !cmsg ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(nfd * sizeof(int))) {
+    fprintf(stderr, "relay at %s refused the upgrade, check -w, -t and "
+                    "-p match\n",
+            path);
+    exit(1);
+  }
+  memcpy(fds, CMSG_DATA(cmsg), nfd * sizeof(int));
+  for (int i = 0, k = 0; i < nworker; ++i) {
+    workers[i].sock = fds[k++];
+    if (trunked)
+      workers[i].trunk_sock = fds[k++];
+  }
+
+  size_t nsession = get32(header + 4);
+  for (size_t i = 0; i < nsession; ++i) {
+    uint8_t rec[1 + SESSION_BLOB_SIZE];
+    session_t *s = malloc(sizeof(*s));
+    if (!s)
+      die("malloc");
+    if (read_all(c, rec, sizeof(rec)) < 0 || rec[0] >= nworker ||
+        session_deserialise(s, hot, rec + 1) < 0) {
+      fprintf(stderr, "relay: bad session from the old relay\n");
+      exit(1);
+    }
+    install(&workers[rec[0]], s);
+  }
+  close(c);
+
+  fprintf(stderr, "relay: took over %zu sessions\n", nsession);
+  return (uint64_t)get32(header + 8) << 32 | get32(header + 12);
+}
+
+/*
+ * Benchmark of tick processing, -T. Every tick, both players' CMD and ACK
+ * for the next epoch of every session are observed in a random order, as
+ * they would arrive, and then every session is stepped.
+ */
+
+static const size_t BENCH_SESSIONS[] = {1000, 10000, 100000};
+static const uint32_t BENCH_TICKS = 200;
+/* Each figure is the best of this many runs. */
+static const int BENCH_RUNS = 3;
+
+/* Nanoseconds per session per tick with n sessions. */
+static double bench_tick(size_t n, bool batched) {
+  /* Session ids are 16 bits, so more sessions take more stores. */
+  size_t nstore = (n + NSESSION - 1) / NSESSION;
+  session_hot_t *store =
+      aligned_alloc(64, nstore * NSESSION * sizeof(*store));
+  session_t *s = malloc(n * sizeof(*s));
+  session_t **due = malloc(n * sizeof(*due));
+  session_hot_t **due_hot = malloc(n * sizeof(*due_hot));
+  uint32_t *order = malloc(4 * n * sizeof(*order));
+  sim_soa_t *soa = malloc(sizeof(*soa));
+  if (!store || !s || !due || !due_hot || !order || !soa)
+    die("malloc");
+
+  /* The stores are back to back, so the hot half of session i is store[i],
+   * as hot[id] is in the relay. */
+  for (size_t i = 0; i < n; ++i)
+    session_init(&s[i], store + i / NSESSION * NSESSION, i % NSESSION);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 4 * n; ++i) {
+    seed = seed * 1103515245 + 12345;
+    size_t j = (seed >> 8) % (i + 1);
+    order[i] = order[j];
+    order[j] = i;
+  }
+
+  uint64_t total_ns = 0;
+  for (uint32_t t = 0; t < BENCH_TICKS; ++t) {
+    uint64_t start = now_ns();
+    for (size_t k = 0; k < 4 * n; ++k) {
+      size_t i = order[k] / 4;
+      uint8_t player = order[k] % 2;
+      session_hot_t *h = &store[i];
+      net_packet_t pkt = {.opcode = order[k] % 4 < 2 ? OPCODE_CMD : OPCODE_ACK,
+                          .epoch = h->epoch,
+                          .input = (i * 7 + player + t / 8) % 3};
+      session_observe(h, player, &pkt);
+    }
+    if (batched) {
+      for (size_t i = 0; i < n; ++i) {
+        due[i] = &s[i];
+        due_hot[i] = &store[i];
+      }
+      session_step_batch(due_hot, due, n, soa);
+    } else {
+      for (size_t i = 0; i < n; ++i)
+        session_step(&store[i], &s[i]);
+    }
+    total_ns += now_ns() - start;
+  }
+
+  free(soa);
+  free(order);
+  free(due_hot);
+  free(due);
+  free(s);
+  free(store);
+  return (double)total_ns / BENCH_TICKS / n;
+}
+
+static double bench_best(size_t n, bool batched) {
+  double best = bench_tick(n, batched);
+  for (int i = 1; i < BENCH_RUNS; ++i) {
+    double ns = bench_tick(n, batched);
+    if (ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+static void bench() {
+  printf("sessions  scalar ns  batch (-B) ns\n");
+  for (size_t i = 0; i < sizeof(BENCH_SESSIONS) / sizeof(*BENCH_SESSIONS);
+       ++i) {
+    size_t n = BENCH_SESSIONS[i];
+    double scalar = bench_best(n, false);
+    printf("%8zu  %9.1f  %13.1f\n", n, scalar, bench_best(n, true));
+  }
+}
+
+static void usage(const char *program_name) {
+  fprintf(stderr, "Usage: %s [-w workers] [-b budget_us] [-s edf|rr] [-B] [-u path] [-t trunk_port -p peer_host:peer_trunk_port] <port>\n", program_name);
+  fprintf(stderr, "       %s -T\n", program_name);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -w workers     Worker threads, on ports port to port + workers - 1\n");
+  fprintf(stderr, "  -b budget_us   Only admit new sessions to a worker whose p99 tick\n");
+  fprintf(stderr, "                 time plus lateness is below this (default 5000)\n");
+  fprintf(stderr, "  -s edf|rr      Step due sessions earliest deadline first (default),\n");
+  fprintf(stderr, "                 or in list order\n");
+  fprintf(stderr, "  -B             Step the sessions due together, in SoA batches\n");
+  fprintf(stderr, "  -u path        Take over from the relay listening at path, and\n");
+  fprintf(stderr, "                 listen there for the next upgrade\n");
+  fprintf(stderr, "  -t trunk_port  Port to receive trunk datagrams on\n");
+  fprintf(stderr, "  -p host:port   Trunk of the peer relay\n");
+  fprintf(stderr, "  -T             Benchmark tick processing at 1k, 10k and 100k\n");
+  fprintf(stderr, "                 sessions, in ns per session per tick, and exit\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Both relays of a trunk must run the same number of workers.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Examples:\n");
+  fprintf(stderr, "  %s 9900\n", program_name);
+  fprintf(stderr, "  %s -w 4 -t 9910 -p 10.0.0.2:9910 9900\n", program_name);
+  fprintf(stderr, "  %s -u /run/xpong-relay.sock 9900\n", program_name);
+}
+
+int main(int argc, char *argv[argc + 1]) {
+  const char *peer = NULL, *upgrade = NULL;
+  long trunk_port = -1;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:b:s:Bu:t:p:T")) != -1) {
+    switch (opt) {
+    case 's':
+      if (strcmp(optarg, "edf") && strcmp(optarg, "rr")) {
+        usage(argv[0]);
+        return 1;
+      }
+      edf = !strcmp(optarg, "edf");
+      break;
+    case 'B':
+      batch = true;
+      break;
+    case 'b':
+      budget_us = atol(optarg);
+      break;
+    case 'u':
+      upgrade = optarg;
+      break;
+    case 'w':
+      nworker = atoi(optarg);
+      break;
+    case 't':
+      trunk_port = atol(optarg);
+      break;
+    case 'p':
+      peer = optarg;
+      break;
+    case 'T':
+      bench();
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || (trunk_port < 0) != (peer == NULL) ||
+      nworker < 1 || nworker > MAX_WORKER) {
+    usage(argv[0]);
+    return 1;
+  }
+  unsigned short port = atoi(argv[optind]);
+  trunked = peer != NULL;
+  net_selftest();
+  if (session_selftest())
+    return 1;
+  fprintf(stderr, "using net codec %s\n", net_codec_name());
+
+  for (size_t i = 0; i < NSESSION; ++i)
+    atomic_init(&owner[i], OWNER_NONE);
+
+  workers = calloc(nworker, sizeof(*workers));
+  if (!workers)
+    die("calloc");
+  pthread_barrier_init(&freeze_barrier, NULL, nworker);
+  for (int i = 0; i < nworker; ++i) {
+    worker_t *w = &workers[i];
+    w->id = i;
+    w->trunk_sock = -1;
+    w->trunk_len = TRUNK_HEADER;
+    if (trunked) {
+      resolve(&w->trunk_peer, peer);
+      w->trunk_peer.sin_port = htons(ntohs(w->trunk_peer.sin_port) + i);
+    }
+    if (pipe(w->wake) < 0)
+      die("pipe");
+    fcntl(w->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(w->wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&w->lock, NULL);
+    w->mail_tail = &w->mail;
+    if (batch && !(w->soa = malloc(sizeof(*w->soa))))
+      die("malloc");
+  }
+
+  uint64_t freeze_ns = upgrade ? take_over(upgrade) : 0;
+  for (int i = 0; !freeze_ns && i < nworker; ++i) {
+    workers[i].sock = bind_udp(port + i);
+    if (trunked)
+      workers[i].trunk_sock = bind_udp(trunk_port + i);
+  }
+  /* Again for sockets taken over, in case the old relay did not. */
+  for (int i = 0; i < nworker; ++i)
+    net_filter(workers[i].sock);
+
+  for (int i = 0; i < nworker; ++i) {
+    if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+      die("pthread_create");
+  }
+  if (freeze_ns)
+    fprintf(stderr, "relay: sessions were frozen for %llu us\n",
+            (unsigned long long)(now_ns() - freeze_ns) / 1000);
+
+  if (upgrade)
+    serve_upgrade(upgrade);
+  for (int i = 0; i < nworker; ++i)
+    pthread_join(workers[i].thread, NULL);
+  return 0;
+}
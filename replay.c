@@ -0,0 +1,604 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include "replay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Pages are written whole, so they are a multiple of the O_DIRECT block
+ * size, and aligned to it. */
+#define PAGE_BYTES (64 * 1024)
+#define DIRECT_ALIGN 4096
+/* Pages allocated up front. More are allocated, and reported, when the
+ * disk falls behind, up to MAX_PAGE. Then the game waits for the disk. */
+#define NPAGE 4
+#define MAX_PAGE 64
+#define MAX_IOV 64
+
+typedef struct page {
+  struct page *next;
+  size_t len;
+  uint8_t *data;
+} page_t;
+
+struct replay {
+  int fd;
+  bool direct;
+  pthread_t thread;
+  sem_t ready;
+
+  /* Full pages for the writer, oldest first, and pages to reuse. */
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  page_t *queue, **queue_tail, *free;
+  bool closing;
+
+  /* Page being filled, and epochs appended. */
+  page_t *active;
+  uint32_t epoch;
+
+  /* Statistics */
+  size_t npage, queued, max_queued, waits;
+  uint64_t bytes, writes;
+  bool error;
+};
+
+static void die(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+static uint8_t *put16(uint8_t *b, uint16_t v) {
+  b[0] = v >> 8;
+  b[1] = v & 0xFF;
+  return b + 2;
+}
+
+static uint8_t *put32(uint8_t *b, uint32_t v) {
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v & 0xFF;
+  return b + 4;
+}
+
+static uint16_t get16(const uint8_t *b) { return b[0] << 8 | b[1]; }
+
+static uint32_t get32(const uint8_t *b) {
+  return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 |
+         b[3];
+}
+
+static page_t *new_page() {
+  page_t *p = malloc(sizeof(*p));
+  if (!p || posix_memalign((void **)&p->data, DIRECT_ALIGN, PAGE_BYTES))
+    die("replay");
+  p->len = 0;
+  return p;
+}
+
+/* pwritev all of iov at offset, resuming after short writes. */
+static void write_iov(replay_t *r, struct iovec *iov, int n, off_t offset) {
+  while (n > 0) {
+    ssize_t done = pwritev(r->fd, iov, n, offset);
+    if (done < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("replay");
+      r->error = true;
+      return;
+    }
+    ++r->writes;
+    offset += done;
+    for (; n > 0 && (size_t)done >= iov->iov_len; ++iov, --n)
+      done -= iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+}
+
+static void *writer(void *arg) {
+  replay_t *r = arg;
+  off_t offset = 0;
+  bool closing = false;
+  while (!closing) {
+    sem_wait(&r->ready);
+    pthread_mutex_lock(&r->lock);
+    page_t *batch = r->queue;
+    r->queue = NULL;
+    r->queue_tail = &r->queue;
+    closing = r->closing;
+    pthread_mutex_unlock(&r->lock);
+
+    while (batch) {
+      struct iovec iov[MAX_IOV];
+      page_t *pages[MAX_IOV];
+      int n = 0;
+      off_t len = 0;
+      for (; batch && n < MAX_IOV; batch = batch->next, ++n) {
+        pages[n] = batch;
+        /* Only the last page can be short. Under O_DIRECT it is written
+         * padded and the file truncated afterwards. */
+        size_t size = batch->len;
+        if (r->direct)
+          size = (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        iov[n] = (struct iovec){batch->data, size};
+        len += batch->len;
+      }
+      if (!r->error)
+        write_iov(r, iov, n, offset);
+      offset += len;
+
+      pthread_mutex_lock(&r->lock);
+      for (int i = 0; i < n; ++i) {
+        pages[i]->len = 0;
+        pages[i]->next = r->free;
+        r->free = pages[i];
+      }
+      r->queued -= n;
+      pthread_cond_signal(&r->freed);
+      pthread_mutex_unlock(&r->lock);
+    }
+  }
+  return NULL;
+}
+
+static page_t *take_page(replay_t *r) {
+  pthread_mutex_lock(&r->lock);
+  /* Rather than queue without bound, wait for the writer to free a page,
+   * even after a write error, as it keeps freeing them. */
+  if (!r->free && r->npage == MAX_PAGE) {
+    ++r->waits;
+    while (!r->free)
+      pthread_cond_wait(&r->freed, &r->lock);
+  }
+  page_t *p = r->free;
+  if (p)
+    r->free = p->next;
+  size_t queued = r->queued;
+  pthread_mutex_unlock(&r->lock);
+  if (p)
+    return p;
+
+  if (r->npage++ == NPAGE)
+    fprintf(stderr, "replay: disk is falling behind, %zu pages queued\n",
+            queued);
+  return new_page();
+}
+
+static void queue_page(replay_t *r, page_t *p) {
+  p->next = NULL;
+  pthread_mutex_lock(&r->lock);
+  *r->queue_tail = p;
+  r->queue_tail = &p->next;
+  if (++r->queued > r->max_queued)
+    r->max_queued = r->queued;
+  pthread_mutex_unlock(&r->lock);
+  sem_post(&r->ready);
+}
+
+static void put(replay_t *r, const uint8_t *b, size_t n) {
+  r->bytes += n;
+  while (n) {
+    page_t *p = r->active;
+    size_t k = PAGE_BYTES - p->len;
+    if (k > n)
+      k = n;
+    memcpy(p->data + p->len, b, k);
+    p->len += k;
+    b += k;
+    n -= k;
+    if (p->len == PAGE_BYTES) {
+      queue_page(r, p);
+      r->active = take_page(r);
+    }
+  }
+}
+
+replay_t *replay_create(const char *path, uint16_t tick_ms, bool direct) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int fd = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+  if (fd < 0 && direct && errno == EINVAL) {
+    fprintf(stderr, "replay: no O_DIRECT on %s, writing through the page "
+                    "cache\n",
+            path);
+    direct = false;
+    fd = open(path, flags, 0644);
+  }
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+
+  replay_t *r = calloc(1, sizeof(*r));
+  if (!r)
+    die("replay");
+  r->fd = fd;
+  r->direct = direct;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->freed, NULL);
+  sem_init(&r->ready, 0, 0);
+  r->queue_tail = &r->queue;
+  for (r->npage = 0; r->npage < NPAGE; ++r->npage) {
+    page_t *p = new_page();
+    p->next = r->free;
+    r->free = p;
+  }
+  r->active = take_page(r);
+
+  uint8_t header[REPLAY_HEADER_SIZE] = {0}, *b = header;
+  b = put32(b, REPLAY_MAGIC);
+  b = put16(b, REPLAY_VERSION);
+  *b++ = NPLAYER;
+#ifdef SIM_FIXED
+  *b++ = REPLAY_FIXED;
+#else
+  *b++ = 0;
+#endif
+  b = put16(b, REPLAY_KEYFRAME);
+  b = put16(b, tick_ms);
+  b = put16(b, REPLAY_STATE_WORDS);
+  put(r, header, sizeof(header));
+
+  if (pthread_create(&r->thread, NULL, writer, r))
+    die("pthread_create");
+  return r;
+}
+
+static void put_keyframe(replay_t *r, const state_t *state) {
+  uint8_t buff[REPLAY_KEYFRAME_SIZE], *b = buff;
+  uint64_t hash = sim_hash(state);
+  b = put32(b, r->epoch);
+  b = put32(b, hash >> 32);
+  b = put32(b, hash);
+  uint32_t w[REPLAY_STATE_WORDS];
+  memcpy(w, state, sizeof(w));
+  for (size_t i = 0; i < REPLAY_STATE_WORDS; ++i)
+    b = put32(b, w[i]);
+  put(r, buff, sizeof(buff));
+}
+
+void replay_append(replay_t *r, const state_t *state,
+                   const cmd_t cmds[NPLAYER]) {
+  if (r->epoch % REPLAY_KEYFRAME == 0)
+    put_keyframe(r, state);
+  ++r->epoch;
+
+  page_t *p = r->active;
+  if (p->len + NPLAYER < PAGE_BYTES) {
+    for (size_t i = 0; i < NPLAYER; ++i)
+      p->data[p->len++] = cmds[i];
+    r->bytes += NPLAYER;
+    return;
+  }
+  uint8_t inputs[NPLAYER];
+  for (size_t i = 0; i < NPLAYER; ++i)
+    inputs[i] = cmds[i];
+  put(r, inputs, NPLAYER);
+}
+
+bool replay_close(replay_t *r, const state_t *state) {
+  if (!r)
+    return true;
+
+  uint8_t trailer[REPLAY_TRAILER_SIZE], *b = trailer;
+  uint64_t hash = sim_hash(state);
+  b = put32(b, r->epoch);
+  b = put32(b, hash >> 32);
+  put32(b, hash);
+  put(r, trailer, sizeof(trailer));
+
+  /* The last page goes with the flag, so the writer sees both at once. */
+  r->active->next = NULL;
+  pthread_mutex_lock(&r->lock);
+  *r->queue_tail = r->active;
+  if (++r->queued > r->max_queued)
+    r->max_queued = r->queued;
+  r->closing = true;
+  pthread_mutex_unlock(&r->lock);
+  sem_post(&r->ready);
+  pthread_join(r->thread, NULL);
+  if (r->direct && ftruncate(r->fd, r->bytes) < 0) {
+    perror("replay");
+    r->error = true;
+  }
+  if (close(r->fd) < 0) {
+    perror("replay");
+    r->error = true;
+  }
+
+  fprintf(stderr, "replay: %u epochs, %llu bytes in %llu writes, at most "
+                  "%zu of %zu pages queued, waited %zu times for the disk\n",
+          (unsigned)r->epoch, (unsigned long long)r->bytes,
+          (unsigned long long)r->writes, r->max_queued, r->npage, r->waits);
+  bool ok = !r->error;
+  if (!ok)
+    fprintf(stderr, "replay: a write failed, the replay is incomplete\n");
+
+  while (r->free) {
+    page_t *p = r->free;
+    r->free = p->next;
+    free(p->data);
+    free(p);
+  }
+  sem_destroy(&r->ready);
+  pthread_cond_destroy(&r->freed);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+  return ok;
+}
+
+static state_t get_state(const uint8_t *b) {
+  uint32_t w[REPLAY_STATE_WORDS];
+  for (size_t i = 0; i < REPLAY_STATE_WORDS; ++i)
+    w[i] = get32(b + 4 * i);
+  state_t state;
+  memcpy(&state, w, sizeof(state));
+  return state;
+}
+
+struct replay_file {
+  uint8_t *buff;
+  size_t nepoch;
+  float dt;
+  /* The sim_hash of the final state, if the file has a trailer. */
+  bool trailer;
+  uint64_t hash;
+};
+
+replay_file_t *replay_open(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  uint8_t *buff = NULL;
+  size_t size = 0, cap = 0, got;
+  do {
+    if (size == cap) {
+      cap = cap ? 2 * cap : 1 << 16;
+      if (!(buff = realloc(buff, cap)))
+        die("replay");
+    }
+    size += got = fread(buff + size, 1, cap - size, f);
+  } while (got);
+  fclose(f);
+
+#ifdef SIM_FIXED
+  const uint8_t flags = REPLAY_FIXED;
+#else
+  const uint8_t flags = 0;
+#endif
+  uint16_t version = size < REPLAY_HEADER_SIZE ? 0 : get16(buff + 4);
+  if (size < REPLAY_HEADER_SIZE || get32(buff) != REPLAY_MAGIC ||
+      (version != 1 && version != REPLAY_VERSION) || buff[6] != NPLAYER ||
+      buff[7] != flags || get16(buff + 8) != REPLAY_KEYFRAME ||
+      get16(buff + 12) != REPLAY_STATE_WORDS) {
+    fprintf(stderr, "%s is not a replay this build can simulate\n", path);
+    free(buff);
+    return NULL;
+  }
+
+  bool trailer = version != 1;
+  size_t body = size - REPLAY_HEADER_SIZE;
+  if (trailer && body < REPLAY_TRAILER_SIZE) {
+    fprintf(stderr, "%s is truncated\n", path);
+    free(buff);
+    return NULL;
+  }
+  if (trailer)
+    body -= REPLAY_TRAILER_SIZE;
+  /* Every block but the last is whole. */
+  size_t nblock = (body + REPLAY_BLOCK_SIZE - 1) / REPLAY_BLOCK_SIZE;
+  size_t tail = body - (nblock - 1) * REPLAY_BLOCK_SIZE;
+  size_t nepoch = nblock ? (nblock - 1) * REPLAY_KEYFRAME +
+                               (tail - REPLAY_KEYFRAME_SIZE) / NPLAYER
+                         : 0;
+  const uint8_t *t = buff + size - REPLAY_TRAILER_SIZE;
+  if ((nblock && (tail < REPLAY_KEYFRAME_SIZE ||
+                  (tail - REPLAY_KEYFRAME_SIZE) % NPLAYER)) ||
+      (trailer && get32(t) != nepoch)) {
+    fprintf(stderr, "%s is truncated\n", path);
+    free(buff);
+    return NULL;
+  }
+
+  replay_file_t *r = malloc(sizeof(*r));
+  if (!r)
+    die("replay");
+  r->buff = buff;
+  r->nepoch = nepoch;
+  r->dt = get16(buff + 10) / 1000.f;
+  r->trailer = trailer;
+  r->hash = trailer ? (uint64_t)get32(t + 4) << 32 | get32(t + 8) : 0;
+  return r;
+}
+
+size_t replay_length(const replay_file_t *r) { return r->nepoch; }
+
+static const uint8_t *block(const replay_file_t *r, size_t b) {
+  return r->buff + REPLAY_HEADER_SIZE + b * REPLAY_BLOCK_SIZE;
+}
+
+static const uint8_t *epoch_cmds(const replay_file_t *r, size_t e) {
+  return block(r, e / REPLAY_KEYFRAME) + REPLAY_KEYFRAME_SIZE +
+         e % REPLAY_KEYFRAME * NPLAYER;
+}
+
+state_t replay_keyframe(const replay_file_t *r, size_t b, uint64_t *hash) {
+  const uint8_t *k = block(r, b);
+  if (hash)
+    *hash = (uint64_t)get32(k + 4) << 32 | get32(k + 8);
+  return get_state(k + 12);
+}
+
+void replay_cmds(const replay_file_t *r, size_t e, cmd_t cmds[NPLAYER]) {
+  const uint8_t *b = epoch_cmds(r, e);
+  for (size_t i = 0; i < NPLAYER; ++i)
+    cmds[i] = b[i];
+}
+
+#ifdef SIM_FIXED
+/* Inputs rarely change from one epoch to the next, so step each run of
+ * equal inputs in one go. */
+static void simulate(const replay_file_t *r, state_t *state, size_t from,
+                     size_t to) {
+  sim_compact_t c = sim_compact(state);
+  while (from < to) {
+    const uint8_t *b = epoch_cmds(r, from);
+    size_t run = 1;
+    while (from + run < to && !memcmp(epoch_cmds(r, from + run), b, NPLAYER))
+      ++run;
+    cmd_t cmds[NPLAYER];
+    replay_cmds(r, from, cmds);
+    sim_skip_compact(&c, state, cmds, run);
+    from += run;
+  }
+  sim_expand(state, &c);
+}
+#else
+static void simulate(const replay_file_t *r, state_t *state, size_t from,
+                     size_t to) {
+  for (; from < to; ++from) {
+    cmd_t cmds[NPLAYER];
+    replay_cmds(r, from, cmds);
+    *state = sim_update(state, cmds, r->dt);
+  }
+}
+#endif
+
+bool replay_seek(const replay_file_t *r, size_t epoch, state_t *state) {
+  /* An empty replay has not even the keyframe of block 0. */
+  if (!r->nepoch || epoch > r->nepoch)
+    return false;
+  size_t b = epoch / REPLAY_KEYFRAME;
+  /* The state after the last epoch of a whole last block has no keyframe. */
+  if (b && epoch == r->nepoch && epoch % REPLAY_KEYFRAME == 0)
+    --b;
+  *state = replay_keyframe(r, b, NULL);
+  simulate(r, state, b * REPLAY_KEYFRAME, epoch);
+  return true;
+}
+
+typedef struct verify {
+  const replay_file_t *r;
+  size_t nblock;
+  _Atomic size_t next, bad;
+} verify_t;
+
+/* Check that keyframe b is what it says it is, and that its block ends
+ * exactly at the next one, or the last block at the trailer. */
+static bool verify_block(const replay_file_t *r, size_t nblock, size_t b) {
+  uint64_t hash;
+  state_t state = replay_keyframe(r, b, &hash);
+  if (get32(block(r, b)) != b * REPLAY_KEYFRAME || sim_hash(&state) != hash) {
+    fprintf(stderr, "keyframe %zu does not match its hash\n", b);
+    return false;
+  }
+  if (b + 1 == nblock) {
+    /* Version 1 files leave the last block unchecked. */
+    if (!r->trailer)
+      return true;
+    simulate(r, &state, b * REPLAY_KEYFRAME, r->nepoch);
+    if (sim_hash(&state) != r->hash) {
+      fprintf(stderr, "epochs %zu to %zu do not end at the trailer\n",
+              b * REPLAY_KEYFRAME, r->nepoch - 1);
+      return false;
+    }
+    return true;
+  }
+
+  simulate(r, &state, b * REPLAY_KEYFRAME, (b + 1) * REPLAY_KEYFRAME);
+  state_t next = replay_keyframe(r, b + 1, &hash);
+  if (memcmp(&state, &next, sizeof(state)) || sim_hash(&state) != hash) {
+    fprintf(stderr, "epochs %zu to %zu do not end at keyframe %zu\n",
+            b * REPLAY_KEYFRAME, (b + 1) * REPLAY_KEYFRAME - 1, b + 1);
+    return false;
+  }
+  return true;
+}
+
+static void *verify_worker(void *arg) {
+  verify_t *v = arg;
+  /* Blocks are handed out one at a time, as runs of equal inputs make some
+   * much quicker to simulate than others. */
+  for (size_t b; (b = atomic_fetch_add(&v->next, 1)) < v->nblock;)
+    if (!verify_block(v->r, v->nblock, b))
+      atomic_fetch_add(&v->bad, 1);
+  return NULL;
+}
+
+size_t replay_verify(const replay_file_t *r, int nthread) {
+  verify_t v = {r, (r->nepoch + REPLAY_KEYFRAME - 1) / REPLAY_KEYFRAME};
+  /* No more threads than blocks, however many were asked for. */
+  if ((size_t)nthread > v.nblock)
+    nthread = v.nblock;
+  if (nthread < 1)
+    nthread = 1;
+  pthread_t *thread = malloc(nthread * sizeof(*thread));
+  if (!thread)
+    die("replay");
+  int nstarted = 1;
+  for (; nstarted < nthread; ++nstarted)
+    if ((errno = pthread_create(&thread[nstarted], NULL, verify_worker, &v))) {
+      perror("pthread_create");
+      break;
+    }
+  verify_worker(&v);
+  for (int i = 1; i < nstarted; ++i)
+    pthread_join(thread[i], NULL);
+  free(thread);
+  return v.bad;
+}
+
+void replay_free(replay_file_t *r) {
+  if (!r)
+    return;
+  free(r->buff);
+  free(r);
+}
+
+state_t *replay_states(const char *path, size_t *n) {
+  replay_file_t *r = replay_open(path);
+  if (!r)
+    return NULL;
+  *n = r->nepoch;
+  state_t *states = malloc((*n ? *n : 1) * sizeof(*states));
+  if (!states)
+    die("replay");
+  for (size_t e = 0; e < *n; ++e) {
+    state_t state = e % REPLAY_KEYFRAME
+                        ? states[e - 1]
+                        : replay_keyframe(r, e / REPLAY_KEYFRAME, NULL);
+    cmd_t cmds[NPLAYER];
+    replay_cmds(r, e, cmds);
+    states[e] = sim_update(&state, cmds, r->dt);
+  }
+  replay_free(r);
+  return states;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "simulate.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Replay files: a header, then blocks of REPLAY_KEYFRAME epochs. A block
+ * starts with a keyframe, the state the first epoch of the block simulates
+ * from, followed by the NPLAYER input bytes of each epoch. The last block
+ * may be short, and is followed by the trailer, which version 1 files do
+ * not have. All numbers are big endian.
+ *
+ * header:   magic, u16 version, u8 nplayer, u8 flags, u16 keyframe
+ *           interval, u16 tick in ms, u16 state words, u16 reserved
+ * keyframe: u32 epoch, u64 sim_hash of the state, the state as u32 words
+ * trailer:  u32 epochs, u64 sim_hash of the state after the last one
+ */
+
+#define REPLAY_MAGIC 0x58505250 /* "XPRP" */
+#define REPLAY_VERSION 2
+#define REPLAY_KEYFRAME 256
+/* The match was simulated in fixed point, see SIM_FIXED. */
+#define REPLAY_FIXED 1
+
+#define REPLAY_HEADER_SIZE 16
+#define REPLAY_TRAILER_SIZE 12
+#define REPLAY_STATE_WORDS (sizeof(state_t) / sizeof(uint32_t))
+#define REPLAY_KEYFRAME_SIZE (4 + 8 + 4 * REPLAY_STATE_WORDS)
+#define REPLAY_BLOCK_SIZE                                                      \
+  (REPLAY_KEYFRAME_SIZE + REPLAY_KEYFRAME * NPLAYER)
+
+typedef struct replay replay_t;
+
+/* Write a replay to path from a background thread, so that appending never
+ * waits for the disk. direct asks for O_DIRECT where the file system has
+ * it. NULL on failure. */
+replay_t *replay_create(const char *path, uint16_t tick_ms, bool direct);
+/* Record that cmds were simulated from state. */
+void replay_append(replay_t *r, const state_t *state,
+                   const cmd_t cmds[NPLAYER]);
+/* Write out everything, with state, the state after the last epoch
+ * appended, in the trailer, and report how the disk kept up. Returns
+ * false, and says so, if a write failed and the replay is incomplete. */
+bool replay_close(replay_t *r, const state_t *state);
+
+typedef struct replay_file replay_file_t;
+
+/* Read the replay at path into memory. NULL with a message if the file is
+ * not a replay this build can simulate. */
+replay_file_t *replay_open(const char *path);
+void replay_free(replay_file_t *r);
+/* Epochs recorded. */
+size_t replay_length(const replay_file_t *r);
+/* The keyframe of block b, the state epoch b * REPLAY_KEYFRAME simulates
+ * from, and its recorded sim_hash if hash is not NULL. */
+state_t replay_keyframe(const replay_file_t *r, size_t b, uint64_t *hash);
+/* The inputs of epoch e. */
+void replay_cmds(const replay_file_t *r, size_t e, cmd_t cmds[NPLAYER]);
+/* The state after the first epoch epochs, at most replay_length, simulated
+ * from the nearest keyframe. Built with SIM_FIXED, runs of epochs with
+ * equal inputs are skipped with sim_skip_compact rather than stepped.
+ * Returns false if there is no such state, as the replay is empty or
+ * shorter. */
+bool replay_seek(const replay_file_t *r, size_t epoch, state_t *state);
+/* Check that each keyframe matches its hash and that simulating each block
+ * from its keyframe ends exactly at the next one, or for the last block at
+ * the hash in the trailer. The blocks are simulated independently, on
+ * nthread threads, but no more than there are blocks. Reports the ones
+ * that fail and returns their number. */
+size_t replay_verify(const replay_file_t *r, int nthread);
+
+/* Read the replay at path and simulate it. Returns the state after each
+ * epoch and their number in n, or NULL with a message if the file is not
+ * a replay this build can simulate. */
+state_t *replay_states(const char *path, size_t *n);
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "session.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Must match the field and epoch length of xpong.c. */
+static const int FIELD_WIDTH = 720;
+static const int FIELD_HEIGHT = 640;
+static const int SIM_INTERVAL = 10;
+
+#define SEEN_ALL_CMD ((1 << NPLAYER) - 1)
+
+/* The state every session starts from, whose constant fields all sessions
+ * share. */
+static state_t field;
+
+__attribute__((constructor)) static void init_field() {
+  field = sim_init(FIELD_WIDTH, FIELD_HEIGHT);
+}
+
+static void load_state(const session_hot_t *h, state_t *state) {
+  *state = field;
+  for (size_t i = 0; i < NPLAYER; ++i)
+    state->paddle[i].pos.y = h->paddle_y[i];
+  state->ball.pos = h->ball_pos;
+  state->ball.vel = h->ball_vel;
+}
+
+static void store_state(session_hot_t *h, const state_t *state) {
+  for (size_t i = 0; i < NPLAYER; ++i)
+    h->paddle_y[i] = state->paddle[i].pos.y;
+  h->ball_pos = state->ball.pos;
+  h->ball_vel = state->ball.vel;
+}
+
+void session_init(session_t *s, session_hot_t *store, uint16_t id) {
+  memset(s, 0, sizeof(*s));
+  s->hot = &store[id];
+  memset(s->hot, 0, sizeof(*s->hot));
+  s->id = s->hot->id = id;
+  store_state(s->hot, &field);
+}
+
+void session_observe(session_hot_t *h, uint8_t player,
+                     const net_packet_t *pkt) {
+  uint16_t ahead = pkt->epoch - h->epoch;
+  if (ahead >= SESSION_WINDOW || player >= NPLAYER)
+    return;
+
+  session_epoch_t *w = &h->window[pkt->epoch % SESSION_WINDOW];
+  switch (pkt->opcode) {
+  case OPCODE_CMD:
+    /* No client sends a command past CMD_DOWN, and clients drop it too. */
+    if (SIM_INPUT_CMD(pkt->input) > CMD_DOWN)
+      return;
+    w->cmd[player] = pkt->input;
+    w->seen |= SEEN_CMD(player);
+    break;
+  case OPCODE_ACK:
+    w->seen |= SEEN_ACK(player);
+    break;
+  }
+}
+
+/* Copy the logged inputs into history, in one go unless they wrap. */
+static void flush_log(session_hot_t *h, uint8_t (*history)[NPLAYER]) {
+  size_t first = (h->nstep - h->nlog) % SESSION_HISTORY;
+  if (first + h->nlog <= SESSION_HISTORY) {
+    memcpy(history[first], h->log, h->nlog * NPLAYER);
+  } else {
+    for (size_t k = 0; k < h->nlog; ++k)
+      memcpy(history[(first + k) % SESSION_HISTORY], h->log[k], NPLAYER);
+  }
+  h->nlog = 0;
+}
+
+/* Take the inputs of the next epoch if they are complete. */
+static bool next_epoch(session_hot_t *h, session_t *s, cmd_t cmds[NPLAYER]) {
+  session_epoch_t *w = &h->window[h->epoch % SESSION_WINDOW];
+  if ((w->seen & SEEN_ALL_CMD) != SEEN_ALL_CMD)
+    return false;
+
+  for (size_t i = 0; i < NPLAYER; ++i)
+    cmds[i] = w->cmd[i];
+  memcpy(h->log[h->nlog++], w->cmd, NPLAYER);
+  memset(w, 0, sizeof(*w));
+  ++h->epoch;
+  ++h->nstep;
+
+  /* Only go out to the history once the log is full. */
+  if (h->nlog == SESSION_LOG)
+    flush_log(h, s->history);
+  return true;
+}
+
+/* The state session_step simulates in. Its constant fields are the same for
+ * every session, so only the ones kept hot are written per step rather than
+ * the whole state copied from field. */
+static _Thread_local state_t scratch;
+static _Thread_local bool scratch_ready;
+
+int session_step(session_hot_t *h, session_t *s) {
+  cmd_t cmds[NPLAYER];
+  if (!next_epoch(h, s, cmds))
+    return 0;
+
+  if (!scratch_ready) {
+    scratch = field;
+    scratch_ready = true;
+  }
+  for (size_t i = 0; i < NPLAYER; ++i)
+    scratch.paddle[i].pos.y = h->paddle_y[i];
+  scratch.ball.pos = h->ball_pos;
+  scratch.ball.vel = h->ball_vel;
+
+  int n = 0;
+  do {
+    scratch = sim_update(&scratch, cmds, SIM_INTERVAL / 1000.f);
+    ++n;
+  } while (next_epoch(h, s, cmds));
+  store_state(h, &scratch);
+  return n;
+}
+
+/* Like sim_soa_gather and sim_soa_scatter, from and to the split session
+ * layout. */
+static void step_soa(sim_soa_t *b, session_hot_t *const *hot,
+                     const cmd_t (*cmds)[NPLAYER], size_t n) {
+  const state_t *c = &field;
+  for (size_t i = 0; i < n; ++i) {
+    const session_hot_t *h = hot[i];
+    for (size_t p = 0; p < NPLAYER; ++p) {
+      b->paddle_x[p][i] = c->paddle[p].pos.x;
+      b->paddle_y[p][i] = h->paddle_y[p];
+      b->paddle_w[p][i] = c->paddle[p].size.x;
+      b->paddle_h[p][i] = c->paddle[p].size.y;
+      b->paddle_speed[p][i] = c->paddle[p].speed;
+      b->cmd[p][i] = cmds[i][p];
+    }
+    b->ball_speed[i] = c->ball.init_speed;
+    b->ball_x[i] = h->ball_pos.x;
+    b->ball_y[i] = h->ball_pos.y;
+    b->ball_vx[i] = h->ball_vel.x;
+    b->ball_vy[i] = h->ball_vel.y;
+    b->ball_r[i] = c->ball.radius;
+    b->bound_x[i] = c->bound.x;
+    b->bound_y[i] = c->bound.y;
+  }
+
+  sim_update_soa(b, n, SIM_INTERVAL / 1000.f);
+
+  for (size_t i = 0; i < n; ++i) {
+    session_hot_t *h = hot[i];
+    for (size_t p = 0; p < NPLAYER; ++p)
+      h->paddle_y[p] = b->paddle_y[p][i];
+    h->ball_pos.x = b->ball_x[i];
+    h->ball_pos.y = b->ball_y[i];
+    h->ball_vel.x = b->ball_vx[i];
+    h->ball_vel.y = b->ball_vy[i];
+  }
+}
+
+int session_step_batch(session_hot_t **h, session_t **s, size_t n,
+                       sim_soa_t *soa) {
+  cmd_t cmds[SIM_SOA_MAX][NPLAYER];
+  int total = 0;
+
+  /* Every round steps each session with a complete epoch once, and drops
+   * the others. The ones to step this round are gathered at the front. */
+  while (n) {
+    size_t keep = 0, m = 0;
+    for (size_t i = 0; i < n; ++i) {
+      session_hot_t *hi = h[i];
+      session_t *si = s[i];
+      if (!next_epoch(hi, si, cmds[m]))
+        continue;
+      h[keep] = hi;
+      s[keep++] = si;
+      if (++m == SIM_SOA_MAX) {
+        step_soa(soa, h + keep - m, cmds, m);
+        total += m;
+        m = 0;
+      }
+    }
+    step_soa(soa, h + keep - m, cmds, m);
+    total += m;
+    n = keep;
+  }
+  return total;
+}
+
+static uint8_t *put16(uint8_t *b, uint16_t v) {
+  b[0] = v >> 8;
+  b[1] = v & 0xFF;
+  return b + 2;
+}
+
+static uint8_t *put32(uint8_t *b, uint32_t v) {
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v & 0xFF;
+  return b + 4;
+}
+
+static uint16_t get16(const uint8_t *b) { return b[0] << 8 | b[1]; }
+
+static uint32_t get32(const uint8_t *b) {
+  return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 |
+         b[3];
+}
+
+void session_serialise(uint8_t *buff, const session_t *s) {
+  uint8_t *b = put16(buff, s->id);
+  for (size_t i = 0; i < NPLAYER; ++i) {
+    *b++ = s->joined[i];
+    b = put32(b, ntohl(s->addr[i].sin_addr.s_addr));
+    b = put16(b, ntohs(s->addr[i].sin_port));
+  }
+
+  const session_hot_t *h = s->hot;
+  b = put16(b, h->epoch);
+  for (size_t i = 0; i < SESSION_WINDOW; ++i) {
+    memcpy(b, h->window[i].cmd, NPLAYER);
+    b += NPLAYER;
+    *b++ = h->window[i].seen;
+  }
+  session_hot_t pending = *h;
+  memcpy(b, s->history, sizeof(s->history));
+  flush_log(&pending, (uint8_t(*)[NPLAYER])b);
+  b += sizeof(s->history);
+  b = put32(b, h->nstep);
+
+  state_t state;
+  load_state(h, &state);
+  uint32_t w[sizeof(state_t) / sizeof(uint32_t)];
+  memcpy(w, &state, sizeof(w));
+  for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); ++i)
+    b = put32(b, w[i]);
+}
+
+int session_deserialise(session_t *s, session_hot_t *store,
+                        const uint8_t *buff) {
+  const uint8_t *b = buff;
+  memset(s, 0, sizeof(*s));
+  s->id = get16(b);
+  b += 2;
+  session_hot_t *h = s->hot = &store[s->id];
+  memset(h, 0, sizeof(*h));
+  h->id = s->id;
+  for (size_t i = 0; i < NPLAYER; ++i) {
+    s->joined[i] = *b++ != 0;
+    s->addr[i].sin_family = AF_INET;
+    s->addr[i].sin_addr.s_addr = htonl(get32(b));
+    s->addr[i].sin_port = htons(get16(b + 4));
+    b += 6;
+  }
+
+  h->epoch = get16(b);
+  b += 2;
+  for (size_t i = 0; i < SESSION_WINDOW; ++i) {
+    memcpy(h->window[i].cmd, b, NPLAYER);
+    b += NPLAYER;
+    h->window[i].seen = *b++;
+  }
+  memcpy(s->history, b, sizeof(s->history));
+  b += sizeof(s->history);
+  h->nstep = get32(b);
+  b += 4;
+
+  uint32_t w[sizeof(state_t) / sizeof(uint32_t)];
+  for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); ++i, b += 4)
+    w[i] = get32(b);
+  state_t state;
+  memcpy(&state, w, sizeof(w));
+  store_state(h, &state);
+
+  /* Sessions only differ in the fields kept hot. */
+  state_t check;
+  load_state(h, &check);
+  if (memcmp(&check, &state, sizeof(state)))
+    return -1;
+
+  return b - buff == SESSION_BLOB_SIZE ? 0 : -1;
+}
+
+int session_selftest() {
+  static session_hot_t store[1];
+  static session_t s;
+  session_init(&s, store, 0);
+  session_hot_t *h = &store[0];
+
+  /* Each round the clients have each other's commands for the epochs the
+   * referee has not stepped yet, move on to the epoch after its own, and
+   * send their commands up to the delay past that. They never repeat one,
+   * as the peer's ACK arrives before they would. */
+  uint16_t sent = 0;
+  for (int round = 0; round < 64; ++round) {
+    uint16_t client = h->epoch + 1;
+    for (; (int16_t)(client + SESSION_MAX_DELAY - sent) >= 0; ++sent)
+      for (uint8_t p = 0; p < NPLAYER; ++p) {
+        net_packet_t pkt = {.opcode = OPCODE_CMD, .epoch = sent};
+        session_observe(h, p, &pkt);
+      }
+    session_step(h, &s);
+    if (h->epoch != sent) {
+      fprintf(stderr, "session: the referee stalled at epoch %u of %u\n",
+              (unsigned)h->epoch, (unsigned)sent);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "network.h"
+#include "simulate.h"
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Epochs the two players can be apart, plus slack. */
+#define SESSION_WINDOW 4
+/* The largest input delay behind a relay. The referee only steps on its
+ * own ticks, so a client can be an epoch past it, and then sends for the
+ * epoch delay + 1 past it, which must still be in the window. */
+#define SESSION_MAX_DELAY (SESSION_WINDOW - 2)
+/* Confirmed inputs kept per session. */
+#define SESSION_HISTORY 256
+
+#define SEEN_CMD(player) (1 << (player))
+#define SEEN_ACK(player) (1 << (NPLAYER + (player)))
+
+typedef struct session_epoch {
+  uint8_t cmd[NPLAYER];
+  uint8_t seen;
+} session_epoch_t;
+
+/* Epochs whose inputs are kept in the hot fields before they go to the
+ * history. */
+#define SESSION_LOG 4
+
+/* What is touched on every tick of a session, in one cache line. Sessions
+ * keep these in a contiguous array indexed by session id, the store, and
+ * everything else on the side in a session_t. */
+typedef struct session_hot {
+  uint64_t deadline_ns;
+  uint32_t nstep;
+  /* Position in the owning worker's deadline heap. */
+  uint16_t heap;
+  uint16_t id;
+
+  /* Next epoch to simulate, and what has been seen of it and the epochs
+   * after it, indexed by epoch % SESSION_WINDOW. */
+  uint16_t epoch;
+  session_epoch_t window[SESSION_WINDOW];
+
+  /* Inputs of the last nlog epochs stepped. */
+  uint8_t nlog;
+  uint8_t log[SESSION_LOG][NPLAYER];
+
+  /* The fields of the state that a step changes, the others are the same
+   * for every session. */
+  float paddle_y[NPLAYER];
+  vec_t ball_pos, ball_vel;
+} __attribute__((aligned(64))) session_hot_t;
+
+_Static_assert(sizeof(session_hot_t) == 64, "session_hot_t is a cache line");
+
+/* A match as seen by a relay, which follows the protocol passing through
+ * it and simulates the confirmed epochs. */
+typedef struct session {
+  session_hot_t *hot;
+  uint16_t id;
+  bool joined[NPLAYER];
+  struct sockaddr_in addr[NPLAYER];
+
+  /* Inputs of the last SESSION_HISTORY epochs, by epoch % SESSION_HISTORY,
+   * up to the ones still in the hot log. */
+  uint8_t history[SESSION_HISTORY][NPLAYER];
+
+  /* Position in the owning worker's session list. */
+  size_t index;
+  /* When the owning worker last heard from each joined player. */
+  uint64_t heard_ns[NPLAYER];
+} session_t;
+
+#define SESSION_BLOB_SIZE                                                      \
+  (2 + NPLAYER * 7 + 2 + SESSION_WINDOW * (NPLAYER + 1) +                      \
+   SESSION_HISTORY * NPLAYER + 4 + sizeof(state_t))
+
+/* Both put the hot fields of the session at store[id]. */
+void session_init(session_t *s, session_hot_t *store, uint16_t id);
+
+/* Follow a packet from player through the session. */
+void session_observe(session_hot_t *h, uint8_t player,
+                     const net_packet_t *pkt);
+
+/* Simulate the epochs of session s, whose hot fields are h, that have their
+ * inputs complete, returns how many. s is only touched every SESSION_LOG
+ * epochs. */
+int session_step(session_hot_t *h, session_t *s);
+
+/* The same for n sessions at once, stepped together through soa. Reorders
+ * h and s. */
+int session_step_batch(session_hot_t **h, session_t **s, size_t n,
+                       sim_soa_t *soa);
+
+/* Network endian, so that a session can move between processes. */
+void session_serialise(uint8_t *buff, const session_t *s);
+int session_deserialise(session_t *s, session_hot_t *store,
+                        const uint8_t *buff);
+
+/* Run a session with clients an epoch ahead of the referee at
+ * SESSION_MAX_DELAY, each command sent once, and check that the referee
+ * keeps up. Returns the number of failures. */
+int session_selftest();
+
+#endif
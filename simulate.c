@@ -20,13 +20,22 @@
 #include <assert.h>
 #include <math.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#ifndef SIM_FIXED
 static float normal(float x) { return x > 0 ? 1 : -1; }
 
+/* The part of dt that input holds its command for, dt itself for a plain
+ * command. */
+static float held_dt(uint32_t input, float dt) {
+  return dt * (float)sim_input_held(input) * (1.f / SIM_SUBTICK);
+}
+
 static paddle_t move_paddle(paddle_t paddle, vec_t bound, cmd_t cmd, float dt) {
-  float cmd_speed[] = {0, paddle.speed, -paddle.speed};
-  paddle.pos.y += cmd_speed[cmd] * dt;
+  float cmd_speed[] = {0, paddle.speed, -paddle.speed, 0};
+  paddle.pos.y += cmd_speed[SIM_INPUT_CMD(cmd)] * held_dt(cmd, dt);
   if (fabsf(paddle.pos.y) + paddle.size.y / 2 > bound.y) {
     paddle.pos.y = normal(paddle.pos.y) * bound.y -
                    normal(paddle.pos.y) * paddle.size.y / 2;
@@ -71,6 +80,7 @@ static ball_t move_ball(ball_t ball, paddle_t paddle[2], vec_t bound,
 
   return ball;
 }
+#endif
 
 state_t sim_init(int width, int height) {
   ball_t ball = {.init_speed = 300,
@@ -88,13 +98,507 @@ state_t sim_init(int width, int height) {
   return state;
 }
 
-state_t sim_update(const state_t *state0, const cmd_t cmd[NPLAYER], float dt) {
+/*
+ * The fixed-point engine, the same rules in integer units. It only steps
+ * whole ticks.
+ */
+
+static int32_t fixed_length(float px) { return lrintf(px * SIM_FIXED_ONE); }
+
+static int32_t fixed_speed(float px_per_s) {
+  return lrintf(px_per_s * SIM_FIXED_ONE / SIM_FIXED_HZ);
+}
+
+static int32_t fixed_normal(int32_t x) { return x > 0 ? 1 : -1; }
+
+sim_compact_t sim_compact(const state_t *state) {
+  sim_compact_t c;
+  for (size_t i = 0; i < NPLAYER; ++i)
+    c.paddle_y[i] = fixed_length(state->paddle[i].pos.y);
+  c.ball_x = fixed_length(state->ball.pos.x);
+  c.ball_y = fixed_length(state->ball.pos.y);
+  c.ball_vx = fixed_speed(state->ball.vel.x);
+  c.ball_vy = fixed_speed(state->ball.vel.y);
+  return c;
+}
+
+void sim_expand(state_t *state, const sim_compact_t *c) {
+  /* Both scales are exact in binary. */
+  const float length = 1.f / SIM_FIXED_ONE;
+  const float speed = (float)SIM_FIXED_HZ / SIM_FIXED_ONE;
+  for (size_t i = 0; i < NPLAYER; ++i)
+    state->paddle[i].pos.y = c->paddle_y[i] * length;
+  state->ball.pos.x = c->ball_x * length;
+  state->ball.pos.y = c->ball_y * length;
+  state->ball.vel.x = c->ball_vx * speed;
+  state->ball.vel.y = c->ball_vy * speed;
+}
+
+void sim_step_compact(sim_compact_t *c, const state_t *field,
+                      const cmd_t cmd[NPLAYER]) {
+  int32_t bound_x = fixed_length(field->bound.x);
+  int32_t bound_y = fixed_length(field->bound.y);
+
+  for (size_t i = 0; i < NPLAYER; ++i) {
+    const paddle_t *p = &field->paddle[i];
+    int32_t speed = fixed_speed(p->speed);
+    int32_t cmd_speed[] = {0, speed, -speed, 0};
+    int32_t half_h = fixed_length(p->size.y) / 2;
+    int32_t v = cmd_speed[SIM_INPUT_CMD(cmd[i])] *
+                (int32_t)sim_input_held(cmd[i]) / SIM_SUBTICK;
+    int32_t y = c->paddle_y[i] + v;
+    if (abs(y) + half_h > bound_y)
+      y = fixed_normal(y) * (bound_y - half_h);
+    c->paddle_y[i] = y;
+  }
+
+  int32_t r = fixed_length(field->ball.radius);
+  int32_t init_speed = fixed_speed(field->ball.init_speed);
+  int32_t x = c->ball_x + c->ball_vx, y = c->ball_y + c->ball_vy;
+  int32_t vx = c->ball_vx, vy = c->ball_vy;
+
+  if (abs(y) + r > bound_y) {
+    y = fixed_normal(y) * (bound_y - r);
+    vy = -vy;
+  }
+
+  if (x) {
+    const paddle_t *p = &field->paddle[x > 0];
+    int32_t px = fixed_length(p->pos.x), py = c->paddle_y[x > 0];
+    int32_t half_w = fixed_length(p->size.x) / 2;
+    int32_t h = fixed_length(p->size.y);
+    if (py - h / 2 < y && y < py + h / 2 && abs(px) - half_w - r < abs(x) &&
+        abs(x) < abs(px) + half_w + r) {
+      x = px - fixed_normal(x) * (r + half_w);
+      vx = -vx;
+      vy = -(py - y) * init_speed * 2 / h;
+    }
+
+    if (abs(x) > bound_x) {
+      x = 0;
+      y = 0;
+      vx = fixed_normal(vx) * init_speed;
+      vy = 0;
+    }
+  }
+
+  c->ball_x = x;
+  c->ball_y = y;
+  c->ball_vx = vx;
+  c->ball_vy = vy;
+}
+
+/* First tick k >= 1 at which |x + k v| > bound, UINT32_MAX if never. */
+static uint32_t first_outside(int32_t x, int32_t v, int32_t bound) {
+  if (v < 0) {
+    x = -x;
+    v = -v;
+  }
+  if (x + v < -bound || x + v > bound)
+    return 1;
+  if (!v)
+    return UINT32_MAX;
+  int64_t k = ((int64_t)bound - x) / v + 1;
+  return k < UINT32_MAX ? k : UINT32_MAX;
+}
+
+/* A paddle moving at v for n ticks, clamped to within limit of the centre. */
+static int32_t skip_paddle(int32_t y, int32_t v, int32_t limit, uint32_t n) {
+  while (n) {
+    uint32_t k = first_outside(y, v, limit);
+    if (k > n)
+      return y + (int32_t)n * v;
+    y = fixed_normal(y + (int32_t)k * v) * limit;
+    n -= k;
+    /* Pushed against the clamp, it stays there. */
+    if (!v || (v > 0) == (y > 0))
+      break;
+  }
+  return y;
+}
+
+void sim_skip_compact(sim_compact_t *c, const state_t *field,
+                      const cmd_t cmd[NPLAYER], uint32_t n) {
+  int32_t bound_y = fixed_length(field->bound.y);
+  int32_t r = fixed_length(field->ball.radius);
+  int32_t v[NPLAYER], limit[NPLAYER];
+  /* Within reach of the centre line the ball can touch neither a paddle
+   * nor a goal. */
+  int32_t reach = fixed_length(field->bound.x);
+  for (size_t i = 0; i < NPLAYER; ++i) {
+    const paddle_t *p = &field->paddle[i];
+    int32_t speed = fixed_speed(p->speed);
+    int32_t cmd_speed[] = {0, speed, -speed, 0};
+    v[i] = cmd_speed[SIM_INPUT_CMD(cmd[i])] * (int32_t)sim_input_held(cmd[i]) /
+           SIM_SUBTICK;
+    limit[i] = bound_y - fixed_length(p->size.y) / 2;
+    int32_t near = abs(fixed_length(p->pos.x)) -
+                   fixed_length(p->size.x) / 2 - r;
+    if (near < reach)
+      reach = near;
+  }
+
+  while (n) {
+    /* Go in a straight line up to the tick where the ball meets a wall or
+     * comes within reach, and step that tick. */
+    uint32_t k = first_outside(c->ball_y, c->ball_vy, bound_y - r);
+    uint32_t kx = first_outside(c->ball_x, c->ball_vx, reach);
+    if (kx < k)
+      k = kx;
+    uint32_t j = k > n ? n : k - 1;
+    if (j) {
+      c->ball_x += (int32_t)j * c->ball_vx;
+      c->ball_y += (int32_t)j * c->ball_vy;
+      for (size_t i = 0; i < NPLAYER; ++i)
+        c->paddle_y[i] = skip_paddle(c->paddle_y[i], v[i], limit[i], j);
+      n -= j;
+    }
+    if (n) {
+      sim_step_compact(c, field, cmd);
+      --n;
+    }
+  }
+}
+
+#ifdef SIM_FIXED
+static inline __attribute__((always_inline)) state_t
+step(const state_t *state0, const cmd_t cmd[NPLAYER], float dt) {
+  assert(lrintf(dt * SIM_FIXED_HZ) == 1);
   state_t state = *state0;
+  sim_compact_t c = sim_compact(&state);
+  sim_step_compact(&c, &state, cmd);
+  sim_expand(&state, &c);
+  return state;
+}
+#else
+static inline __attribute__((always_inline)) state_t
+step(const state_t *state0, const cmd_t cmd[NPLAYER], float dt) {
+  /* Read state0 field by field rather than copy it whole first: callers such
+   * as session_step have just written some of its fields one at a time, and
+   * the wide loads of a copy would wait for those stores to retire. */
+  state_t state;
+  state.bound = state0->bound;
   for (size_t i = 0; i < NPLAYER; ++i) {
-    state.paddle[i] = move_paddle(state.paddle[i], state.bound, cmd[i], dt);
+    state.paddle[i] = move_paddle(state0->paddle[i], state.bound, cmd[i], dt);
   }
 
-  state.ball = move_ball(state.ball, state.paddle, state.bound, dt);
+  state.ball = move_ball(state0->ball, state.paddle, state.bound, dt);
 
   return state;
 }
+#endif
+
+state_t sim_update(const state_t *state0, const cmd_t cmd[NPLAYER], float dt) {
+  return step(state0, cmd, dt);
+}
+
+#ifdef SIM_FIXED
+/* The fixed-point step has nothing to vectorise, so take the slots one at
+ * a time. */
+static inline __attribute__((always_inline)) void
+step_soa(sim_soa_t *b, size_t n, float dt) {
+  for (size_t i = 0; i < n; ++i) {
+    state_t state;
+    cmd_t cmd[NPLAYER];
+    for (size_t p = 0; p < NPLAYER; ++p) {
+      state.paddle[p] = (paddle_t){{b->paddle_x[p][i], b->paddle_y[p][i]},
+                                   {b->paddle_w[p][i], b->paddle_h[p][i]},
+                                   b->paddle_speed[p][i]};
+      cmd[p] = b->cmd[p][i];
+    }
+    state.ball = (ball_t){b->ball_speed[i],
+                          {b->ball_x[i], b->ball_y[i]},
+                          {b->ball_vx[i], b->ball_vy[i]},
+                          b->ball_r[i]};
+    state.bound = (vec_t){b->bound_x[i], b->bound_y[i]};
+
+    state = step(&state, cmd, dt);
+    for (size_t p = 0; p < NPLAYER; ++p)
+      b->paddle_y[p][i] = state.paddle[p].pos.y;
+    b->ball_x[i] = state.ball.pos.x;
+    b->ball_y[i] = state.ball.pos.y;
+    b->ball_vx[i] = state.ball.vel.x;
+    b->ball_vy[i] = state.ball.vel.y;
+  }
+}
+#else
+/* The same step with the branches turned into selects, so that it
+ * vectorises across the slots of a sim_soa_t. */
+static inline __attribute__((always_inline)) void
+step_soa(sim_soa_t *b, size_t n, float dt) {
+  for (size_t p = 0; p < NPLAYER; ++p) {
+    for (size_t i = 0; i < n; ++i) {
+      float speed = b->paddle_speed[p][i];
+      int32_t cmd = b->cmd[p][i];
+      float v = (cmd & 3) == CMD_UP ? speed : 0;
+      v = (cmd & 3) == CMD_DOWN ? -speed : v;
+      float y = b->paddle_y[p][i] + v * held_dt(cmd, dt);
+      float h = b->paddle_h[p][i] / 2;
+      float by = b->bound_y[i];
+      float clamped = normal(y) * by - normal(y) * h;
+      b->paddle_y[p][i] = fabsf(y) + h > by ? clamped : y;
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    float r = b->ball_r[i];
+    float vx = b->ball_vx[i], vy = b->ball_vy[i];
+    float x = b->ball_x[i] + vx * dt;
+    float y = b->ball_y[i] + vy * dt;
+
+    int wall = fabsf(y) + r > b->bound_y[i];
+    float wall_y = normal(y) * b->bound_y[i] - normal(y) * r;
+    y = wall ? wall_y : y;
+    vy = wall ? -vy : vy;
+
+    int moving = x != 0;
+    int right = x > 0;
+    float x0 = b->paddle_x[0][i], x1 = b->paddle_x[1][i];
+    float y0 = b->paddle_y[0][i], y1 = b->paddle_y[1][i];
+    float w0 = b->paddle_w[0][i], w1 = b->paddle_w[1][i];
+    float h0 = b->paddle_h[0][i], h1 = b->paddle_h[1][i];
+    float px = right ? x1 : x0, py = right ? y1 : y0;
+    float pw = right ? w1 : w0, ph = right ? h1 : h0;
+    int hit = moving & (py - ph / 2 < y) & (y < py + ph / 2) &
+              (fabsf(px) - pw / 2 - r < fabsf(x)) &
+              (fabsf(x) < fabsf(px) + pw / 2 + r);
+    float hit_x = px - normal(x) * r - normal(x) * pw / 2;
+    float hit_vy = -(py - y) / ph * b->ball_speed[i] * 2;
+    x = hit ? hit_x : x;
+    vx = hit ? vx * -1 : vx;
+    vy = hit ? hit_vy : vy;
+
+    int goal = moving & (fabsf(x) > b->bound_x[i]);
+    b->ball_x[i] = goal ? 0 : x;
+    b->ball_y[i] = goal ? 0 : y;
+    b->ball_vx[i] = goal ? normal(vx) * b->ball_speed[i] : vx;
+    b->ball_vy[i] = goal ? 0 : vy;
+  }
+}
+#endif
+
+void sim_soa_gather(sim_soa_t *b, state_t *const *states,
+                    const cmd_t (*cmds)[NPLAYER], size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    const state_t *state = states[i];
+    for (size_t p = 0; p < NPLAYER; ++p) {
+      const paddle_t *paddle = &state->paddle[p];
+      b->paddle_x[p][i] = paddle->pos.x;
+      b->paddle_y[p][i] = paddle->pos.y;
+      b->paddle_w[p][i] = paddle->size.x;
+      b->paddle_h[p][i] = paddle->size.y;
+      b->paddle_speed[p][i] = paddle->speed;
+      b->cmd[p][i] = cmds[i][p];
+    }
+    b->ball_speed[i] = state->ball.init_speed;
+    b->ball_x[i] = state->ball.pos.x;
+    b->ball_y[i] = state->ball.pos.y;
+    b->ball_vx[i] = state->ball.vel.x;
+    b->ball_vy[i] = state->ball.vel.y;
+    b->ball_r[i] = state->ball.radius;
+    b->bound_x[i] = state->bound.x;
+    b->bound_y[i] = state->bound.y;
+  }
+}
+
+void sim_soa_scatter(const sim_soa_t *b, state_t *const *states, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    state_t *state = states[i];
+    for (size_t p = 0; p < NPLAYER; ++p)
+      state->paddle[p].pos.y = b->paddle_y[p][i];
+    state->ball.pos.x = b->ball_x[i];
+    state->ball.pos.y = b->ball_y[i];
+    state->ball.vel.x = b->ball_vx[i];
+    state->ball.vel.y = b->ball_vy[i];
+  }
+}
+
+/* FNV-1a over the 32-bit words of the state. */
+static inline __attribute__((always_inline)) uint64_t
+hash(const state_t *state) {
+  uint32_t w[sizeof(state_t) / sizeof(uint32_t)];
+  memcpy(w, state, sizeof(w));
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < sizeof(w) / sizeof(w[0]); ++i) {
+    h ^= w[i];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+uint64_t sim_hash(const state_t *state) { return hash(state); }
+
+/*
+ * Batch kernels. Each variant is the same C code compiled for a different
+ * instruction set: there are no intrinsics, and what vectorises is what
+ * the compiler vectorises, in practice the SoA step. The AoS update and
+ * hash loops gain little beyond wider moves. The variants are only
+ * bit-exact with the scalar code because the Makefile turns off floating
+ * point contraction.
+ */
+
+typedef struct sim_kernel {
+  const char *name;
+  int (*supported)();
+  void (*update)(state_t *, const cmd_t (*)[NPLAYER], size_t, float);
+  void (*update_soa)(sim_soa_t *, size_t, float);
+  void (*hash)(const state_t *, uint64_t *, size_t);
+} sim_kernel_t;
+
+#define SIM_KERNEL(isa, target_isa)                                            \
+  target_isa static void update_batch_##isa(                                  \
+      state_t *states, const cmd_t (*cmds)[NPLAYER], size_t n, float dt) {    \
+    for (size_t i = 0; i < n; ++i)                                             \
+      states[i] = step(&states[i], cmds[i], dt);                               \
+  }                                                                            \
+  target_isa static void update_soa_##isa(sim_soa_t *soa, size_t n,           \
+                                          float dt) {                          \
+    step_soa(soa, n, dt);                                                      \
+  }                                                                            \
+  target_isa static void hash_batch_##isa(const state_t *states,              \
+                                          uint64_t *hashes, size_t n) {        \
+    for (size_t i = 0; i < n; ++i)                                             \
+      hashes[i] = hash(&states[i]);                                            \
+  }
+
+static int always() { return 1; }
+
+#if defined(__x86_64__) || defined(__i386__)
+SIM_KERNEL(sse2, )
+SIM_KERNEL(avx2, __attribute__((target("avx2"))))
+SIM_KERNEL(avx512, __attribute__((target("avx512f,avx512dq,avx512vl"))))
+
+static int has_avx2() { return __builtin_cpu_supports("avx2"); }
+static int has_avx512() {
+  return __builtin_cpu_supports("avx512f") &&
+         __builtin_cpu_supports("avx512dq") &&
+         __builtin_cpu_supports("avx512vl");
+}
+
+/* In ascending order of preference. */
+static const sim_kernel_t kernels[] = {
+    {"sse2", always, update_batch_sse2, update_soa_sse2,
+     hash_batch_sse2},
+    {"avx2", has_avx2, update_batch_avx2, update_soa_avx2,
+     hash_batch_avx2},
+    {"avx512", has_avx512, update_batch_avx512, update_soa_avx512,
+     hash_batch_avx512},
+};
+#elif defined(__aarch64__)
+/* NEON is part of the base instruction set. */
+SIM_KERNEL(neon, )
+
+static const sim_kernel_t kernels[] = {
+    {"neon", always, update_batch_neon, update_soa_neon,
+     hash_batch_neon},
+};
+#else
+SIM_KERNEL(scalar, )
+
+static const sim_kernel_t kernels[] = {
+    {"scalar", always, update_batch_scalar, update_soa_scalar,
+     hash_batch_scalar},
+};
+#endif
+
+#define NKERNEL (sizeof(kernels) / sizeof(kernels[0]))
+
+static const sim_kernel_t *kernel = &kernels[0];
+
+__attribute__((constructor)) static void select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#endif
+  for (size_t i = 0; i < NKERNEL; ++i) {
+    if (kernels[i].supported())
+      kernel = &kernels[i];
+  }
+}
+
+void sim_update_batch(state_t *states, const cmd_t (*cmds)[NPLAYER], size_t n,
+                      float dt) {
+  kernel->update(states, cmds, n, dt);
+}
+
+void sim_update_soa(sim_soa_t *soa, size_t n, float dt) {
+  kernel->update_soa(soa, n, dt);
+}
+
+void sim_hash_batch(const state_t *states, uint64_t *hashes, size_t n) {
+  kernel->hash(states, hashes, n);
+}
+
+const char *sim_kernel_name() { return kernel->name; }
+
+static uint32_t selftest_rand(uint32_t *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
+
+int sim_selftest() {
+  enum { NSTATE = 64, NSTEP = 512 };
+  static state_t init[NSTATE], ref[NSTATE], got[NSTATE];
+  static sim_soa_t soa;
+  static cmd_t cmds[NSTEP][NSTATE][NPLAYER];
+  uint64_t ref_hash[NSTATE], got_hash[NSTATE];
+  state_t *ptrs[NSTATE];
+  uint32_t seed = 1;
+
+  /* Scatter the balls so that the run covers wall, paddle and goal hits. */
+  for (size_t i = 0; i < NSTATE; ++i) {
+    init[i] = sim_init(720, 640);
+    init[i].ball.pos.x = (float)(selftest_rand(&seed) % 600) - 300;
+    init[i].ball.pos.y = (float)(selftest_rand(&seed) % 500) - 250;
+    init[i].ball.vel.y = (float)(selftest_rand(&seed) % 1200) - 600;
+    if (selftest_rand(&seed) & 1)
+      init[i].ball.vel.x *= -1;
+  }
+  for (size_t t = 0; t < NSTEP; ++t)
+    for (size_t i = 0; i < NSTATE; ++i)
+      for (size_t p = 0; p < NPLAYER; ++p) {
+        /* Every other tick, with sub-tick offsets. */
+        uint32_t r = selftest_rand(&seed);
+        cmds[t][i][p] = t % 2 ? r % 3
+                              : SIM_INPUT(r % 3, (r >> 2) % SIM_SUBTICK,
+                                          r >> 7 & 1);
+      }
+  for (size_t i = 0; i < NSTATE; ++i)
+    ptrs[i] = &got[i];
+
+  memcpy(ref, init, sizeof(ref));
+  for (size_t t = 0; t < NSTEP; ++t)
+    for (size_t i = 0; i < NSTATE; ++i)
+      ref[i] = sim_update(&ref[i], cmds[t][i], 0.01f);
+  for (size_t i = 0; i < NSTATE; ++i)
+    ref_hash[i] = sim_hash(&ref[i]);
+
+  int failed = 0;
+  for (size_t k = 0; k < NKERNEL; ++k) {
+    if (!kernels[k].supported())
+      continue;
+
+    memcpy(got, init, sizeof(got));
+    for (size_t t = 0; t < NSTEP; ++t)
+      kernels[k].update(got, cmds[t], NSTATE, 0.01f);
+    kernels[k].hash(got, got_hash, NSTATE);
+    int bad = memcmp(got, ref, sizeof(ref)) ||
+              memcmp(got_hash, ref_hash, sizeof(ref_hash));
+
+    memcpy(got, init, sizeof(got));
+    for (size_t t = 0; t < NSTEP; ++t) {
+      sim_soa_gather(&soa, ptrs, cmds[t], NSTATE);
+      kernels[k].update_soa(&soa, NSTATE, 0.01f);
+      sim_soa_scatter(&soa, ptrs, NSTATE);
+    }
+    bad |= memcmp(got, ref, sizeof(ref)) != 0;
+
+    if (bad) {
+      fprintf(stderr, "sim kernel %s does not match scalar\n",
+              kernels[k].name);
+      if (kernel == &kernels[k])
+        kernel = &kernels[0];
+      ++failed;
+    }
+  }
+  return failed;
+}
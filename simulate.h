@@ -18,6 +18,7 @@
 #ifndef SIMULATE_H
 #define SIMULATE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define NPLAYER 2
@@ -47,7 +48,98 @@ typedef struct state {
 
 typedef enum { CMD_NONE, CMD_UP, CMD_DOWN } cmd_t;
 
+/* An input is a cmd_t in its low bits, and can also say when in the tick
+ * the command changed: it is held from SIM_INPUT_AT(input) / SIM_SUBTICK
+ * of the tick on, or with SIM_INPUT_UNTIL only until then, and the paddle
+ * is idle for the rest of the tick. A plain cmd_t is held for the whole
+ * tick. An input holds one command, so a tick that goes from one command
+ * straight to another, as UP to DOWN, only keeps the second: the paddle is
+ * idle until the change, as if the first had been released there. */
+#define SIM_SUBTICK 32
+#define SIM_INPUT_UNTIL 0x80
+#define SIM_INPUT(cmd, at, until)                                              \
+  ((cmd_t)((cmd) | (at) << 2 | ((until) ? SIM_INPUT_UNTIL : 0)))
+#define SIM_INPUT_CMD(input) ((cmd_t)((input) & 3))
+#define SIM_INPUT_AT(input) (((input) >> 2) & (SIM_SUBTICK - 1))
+
+/* Subticks that input holds its command for. */
+static inline uint32_t sim_input_held(uint32_t input) {
+  uint32_t at = SIM_INPUT_AT(input);
+  return input & SIM_INPUT_UNTIL ? at : SIM_SUBTICK - at;
+}
+
+/* The fields of a state that change during a match, in fixed point:
+ * positions in 1/SIM_FIXED_ONE px and velocities in 1/SIM_FIXED_ONE px per
+ * tick of 1/SIM_FIXED_HZ s. */
+#define SIM_FIXED_ONE 16
+#define SIM_FIXED_HZ 100
+
+typedef struct sim_compact {
+  int16_t paddle_y[NPLAYER];
+  int16_t ball_x, ball_y;
+  int16_t ball_vx, ball_vy;
+} sim_compact_t;
+
 state_t sim_init(int width, int height);
 state_t sim_update(const state_t *state, const cmd_t cmd[NPLAYER], float dt);
 
+/* Round the changing fields of state to fixed point, and write them back
+ * into a state holding the constant fields. Built with SIM_FIXED, every
+ * state is in fixed point and the two are exact inverses. */
+sim_compact_t sim_compact(const state_t *state);
+void sim_expand(state_t *state, const sim_compact_t *compact);
+
+/* Step a compact state one tick with the constant fields of field. This is
+ * what sim_update does when built with SIM_FIXED. */
+void sim_step_compact(sim_compact_t *compact, const state_t *field,
+                      const cmd_t cmd[NPLAYER]);
+
+/* Step a compact state n ticks with the same inputs, exactly as n calls of
+ * sim_step_compact would. The ball is moved in straight lines between the
+ * ticks where it meets a wall or comes near a paddle, so this takes time in
+ * the number of bounces and returns, not in n. */
+void sim_skip_compact(sim_compact_t *compact, const state_t *field,
+                      const cmd_t cmd[NPLAYER], uint32_t n);
+
+/* Step n states in place, states[i] with inputs cmds[i]. Bit-identical to
+ * calling sim_update on each state. */
+void sim_update_batch(state_t *states, const cmd_t (*cmds)[NPLAYER], size_t n,
+                      float dt);
+
+/* Up to SIM_SOA_MAX states laid out field by field, so that the batch
+ * kernels can step several states per instruction. */
+#define SIM_SOA_MAX 256
+
+typedef struct sim_soa {
+  float paddle_x[NPLAYER][SIM_SOA_MAX], paddle_y[NPLAYER][SIM_SOA_MAX];
+  float paddle_w[NPLAYER][SIM_SOA_MAX], paddle_h[NPLAYER][SIM_SOA_MAX];
+  float paddle_speed[NPLAYER][SIM_SOA_MAX];
+  float ball_speed[SIM_SOA_MAX], ball_x[SIM_SOA_MAX], ball_y[SIM_SOA_MAX];
+  float ball_vx[SIM_SOA_MAX], ball_vy[SIM_SOA_MAX], ball_r[SIM_SOA_MAX];
+  float bound_x[SIM_SOA_MAX], bound_y[SIM_SOA_MAX];
+  int32_t cmd[NPLAYER][SIM_SOA_MAX];
+} sim_soa_t;
+
+/* Copy n states and their inputs into the first n slots, and the fields a
+ * step changes back out again. */
+void sim_soa_gather(sim_soa_t *soa, state_t *const *states,
+                    const cmd_t (*cmds)[NPLAYER], size_t n);
+void sim_soa_scatter(const sim_soa_t *soa, state_t *const *states, size_t n);
+
+/* Step the first n slots in place. Bit-identical to sim_update. */
+void sim_update_soa(sim_soa_t *soa, size_t n, float dt);
+
+/* Hash of the exact bit pattern of a state. */
+uint64_t sim_hash(const state_t *state);
+void sim_hash_batch(const state_t *states, uint64_t *hashes, size_t n);
+
+/* The batch kernels are built for several instruction sets and the best one
+ * the CPU supports is picked at startup. */
+const char *sim_kernel_name();
+
+/* Check every kernel the CPU supports against the scalar code, falling back
+ * to the baseline kernel if the selected one mismatches. Returns the number
+ * of mismatching kernels. */
+int sim_selftest();
+
 #endif
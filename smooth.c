@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "smooth.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Move the ball of state up to n ticks on, but not within reach of a
+ * paddle, where the inputs decide where it goes. Returns the ticks moved. */
+static uint32_t ahead(state_t *shown, const state_t *state, uint32_t n,
+                      float dt) {
+  static const cmd_t idle[NPLAYER] = {CMD_NONE};
+  float reach = state->bound.x;
+  for (size_t p = 0; p < NPLAYER; ++p) {
+    const paddle_t *paddle = &state->paddle[p];
+    float near =
+        fabsf(paddle->pos.x) - paddle->size.x / 2 - state->ball.radius;
+    if (near < reach)
+      reach = near;
+  }
+
+  *shown = *state;
+  uint32_t k = 0;
+  for (; k < n; ++k) {
+    state_t next = sim_update(shown, idle, dt);
+    if (fabsf(next.ball.pos.x) >= reach)
+      break;
+    *shown = next;
+  }
+  return k;
+}
+
+void smooth_init(smooth_t *s) { memset(s, 0, sizeof(*s)); }
+
+const state_t *smooth_stall(smooth_t *s, const state_t *state, float dt) {
+  /* Nothing moves before the first epoch. */
+  if (!s->live || s->lead == SMOOTH_MAX_LEAD)
+    return NULL;
+  if (ahead(&s->shown, state, s->lead + 1, dt) == s->lead)
+    return NULL;
+
+  ++s->lead;
+  ++s->stalled;
+  if (s->lead > s->lead_max)
+    s->lead_max = s->lead;
+  return &s->shown;
+}
+
+const state_t *smooth_confirm(smooth_t *s, const state_t *state, float dt) {
+  s->live = true;
+  /* Hold the ball every other tick until the states catch up, so that it
+   * slows down rather than jumping back. */
+  if (s->lead && (s->catch_up = !s->catch_up))
+    --s->lead;
+  s->lead = ahead(&s->shown, state, s->lead, dt);
+  if (!s->lead)
+    s->catch_up = false;
+  return &s->shown;
+}
+
+void smooth_report(const smooth_t *s) {
+  if (!s->stalled)
+    return;
+  fprintf(stderr, "drew the ball ahead on %u stalled ticks, at most %u "
+                  "ticks ahead\n",
+          (unsigned)s->stalled, (unsigned)s->lead_max);
+}
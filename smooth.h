@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SMOOTH_H
+#define SMOOTH_H
+
+#include "simulate.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Ticks the ball is drawn ahead of the confirmed state at most. Longer
+ * stalls freeze the screen as before. */
+#define SMOOTH_MAX_LEAD 8
+
+/* What is drawn while lockstep waits for the peer. Between the paddles the
+ * ball moves the same whatever the inputs, so during a stall it is drawn
+ * where the coming epochs will put it, and the confirmed states catch up
+ * with it afterwards. The simulation itself never sees any of this. */
+typedef struct smooth {
+  bool live;
+  /* Ticks the ball is drawn ahead, and whether the next confirmed epoch
+   * takes one of them back. */
+  uint32_t lead;
+  bool catch_up;
+  state_t shown;
+
+  /* Statistics */
+  uint32_t stalled, lead_max;
+} smooth_t;
+
+void smooth_init(smooth_t *s);
+
+/* A tick passed without a new confirmed state. Returns what to draw, or
+ * NULL if the screen stays as it is. */
+const state_t *smooth_stall(smooth_t *s, const state_t *state, float dt);
+
+/* state was just confirmed. Returns what to draw. */
+const state_t *smooth_confirm(smooth_t *s, const state_t *state, float dt);
+
+void smooth_report(const smooth_t *s);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spectate.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SPEC_DATA 0x10
+#define SPEC_NACK 0x11
+
+#define HEADER_SIZE 6
+/* Epochs per datagram, and per NACK so that one spectator far behind
+ * cannot make the sender flood the group. */
+#define MAX_RUN 255
+/* Refuse streams longer than this, about 46 hours. */
+#define MAX_EPOCH (1u << 24)
+
+static const uint32_t NACK_INTERVAL = 20;
+static const uint32_t HEARTBEAT_INTERVAL = 100;
+
+struct spec {
+  int sock;
+  struct sockaddr_in group_addr;
+  struct sockaddr_in sender_addr;
+  bool have_sender;
+
+  /* Inputs of every epoch so far, NPLAYER bytes each. */
+  uint8_t *inputs;
+  uint8_t *have;
+  uint32_t capacity;
+  /* Sender: number of published epochs. Receiver: next epoch to simulate
+   * and one past the highest epoch seen. */
+  uint32_t nepoch, next, high;
+  uint32_t last_send_tick, last_nack_tick;
+};
+
+static uint32_t tick() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void die(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+static spec_t *spec_new(const char *group) {
+  char host[256];
+  const char *colon = strrchr(group, ':');
+  if (!colon || colon - group >= (int)sizeof(host)) {
+    fprintf(stderr, "bad group address %s, expected address:port\n", group);
+    exit(1);
+  }
+  memcpy(host, group, colon - group);
+  host[colon - group] = '\0';
+
+  spec_t *s = calloc(1, sizeof(*s));
+  if (!s)
+    die("calloc");
+  s->group_addr.sin_family = AF_INET;
+  s->group_addr.sin_port = htons(atoi(colon + 1));
+  if (inet_aton(host, &s->group_addr.sin_addr) == 0 ||
+      !IN_MULTICAST(ntohl(s->group_addr.sin_addr.s_addr))) {
+    fprintf(stderr, "%s is not a multicast address\n", host);
+    exit(1);
+  }
+
+  s->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s->sock < 0)
+    die("socket");
+  return s;
+}
+
+static void reserve(spec_t *s, uint32_t n) {
+  if (n <= s->capacity)
+    return;
+  if (n > MAX_EPOCH) {
+    fprintf(stderr, "spectator stream too long\n");
+    exit(1);
+  }
+
+  uint32_t cap = s->capacity ? s->capacity : 4096;
+  while (cap < n)
+    cap *= 2;
+  s->inputs = realloc(s->inputs, (size_t)cap * NPLAYER);
+  s->have = realloc(s->have, cap);
+  if (!s->inputs || !s->have)
+    die("realloc");
+  memset(s->have + s->capacity, 0, cap - s->capacity);
+  s->capacity = cap;
+}
+
+static void put_header(uint8_t *buff, uint8_t opcode, uint32_t epoch,
+                       uint8_t n) {
+  buff[0] = opcode;
+  buff[1] = epoch >> 24;
+  buff[2] = epoch >> 16;
+  buff[3] = epoch >> 8;
+  buff[4] = epoch & 0xFF;
+  buff[5] = n;
+}
+
+static uint32_t get_epoch(const uint8_t *buff) {
+  return (uint32_t)buff[1] << 24 | (uint32_t)buff[2] << 16 |
+         (uint32_t)buff[3] << 8 | buff[4];
+}
+
+/* Multicast epochs [from, from + n) from the history. */
+static void send_run(spec_t *s, uint32_t from, uint32_t n) {
+  uint8_t buff[HEADER_SIZE + MAX_RUN * NPLAYER];
+  while (n) {
+    uint8_t run = n < MAX_RUN ? n : MAX_RUN;
+    put_header(buff, SPEC_DATA, from, run);
+    memcpy(buff + HEADER_SIZE, s->inputs + (size_t)from * NPLAYER,
+           (size_t)run * NPLAYER);
+    sendto(s->sock, buff, HEADER_SIZE + (size_t)run * NPLAYER, 0,
+           (struct sockaddr *)&s->group_addr, sizeof(s->group_addr));
+    from += run;
+    n -= run;
+  }
+  s->last_send_tick = tick();
+}
+
+spec_t *spec_send_init(const char *group) {
+  spec_t *s = spec_new(group);
+
+  /* Stay on the local network, and let spectators on this host listen. */
+  unsigned char ttl = 1, loop = 1;
+  setsockopt(s->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  setsockopt(s->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+  /* NACKs come back to the source port of the stream. */
+  struct sockaddr_in self = {0};
+  self.sin_family = AF_INET;
+  self.sin_addr.s_addr = INADDR_ANY;
+  if (bind(s->sock, (struct sockaddr *)&self, sizeof(self)) < 0)
+    die("bind");
+  return s;
+}
+
+void spec_publish(spec_t *s, const cmd_t cmds[NPLAYER]) {
+  reserve(s, s->nepoch + 1);
+  for (size_t i = 0; i < NPLAYER; ++i)
+    s->inputs[(size_t)s->nepoch * NPLAYER + i] = cmds[i];
+  send_run(s, s->nepoch++, 1);
+}
+
+void spec_send_poll(spec_t *s) {
+  uint8_t buff[HEADER_SIZE];
+  ssize_t len;
+  while ((len = recv(s->sock, buff, sizeof(buff), MSG_DONTWAIT)) > 0) {
+    if (len != HEADER_SIZE || buff[0] != SPEC_NACK)
+      continue;
+
+    uint32_t from = get_epoch(buff);
+    uint32_t n = buff[5];
+    if (from >= s->nepoch)
+      continue;
+    if (n > s->nepoch - from)
+      n = s->nepoch - from;
+    send_run(s, from, n);
+  }
+
+  /* Let spectators notice losses at the tail of the stream. */
+  if (s->nepoch && tick() - s->last_send_tick >= HEARTBEAT_INTERVAL)
+    send_run(s, s->nepoch - 1, 1);
+}
+
+spec_t *spec_join(const char *group) {
+  spec_t *s = spec_new(group);
+
+  int reuse = 1;
+  setsockopt(s->sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  struct sockaddr_in self = s->group_addr;
+  if (bind(s->sock, (struct sockaddr *)&self, sizeof(self)) < 0)
+    die("bind");
+
+  struct ip_mreq mreq = {.imr_multiaddr = s->group_addr.sin_addr,
+                         .imr_interface.s_addr = INADDR_ANY};
+  if (setsockopt(s->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                 sizeof(mreq)) < 0)
+    die("IP_ADD_MEMBERSHIP");
+  return s;
+}
+
+static void send_nack(spec_t *s) {
+  uint32_t n = 0;
+  while (s->next + n < s->high && n < MAX_RUN && !s->have[s->next + n])
+    ++n;
+  /* Nothing seen yet beyond a gap at the head: ask for a full run. */
+  if (!n)
+    n = MAX_RUN;
+
+  uint8_t buff[HEADER_SIZE];
+  put_header(buff, SPEC_NACK, s->next, n);
+  sendto(s->sock, buff, sizeof(buff), 0, (struct sockaddr *)&s->sender_addr,
+         sizeof(s->sender_addr));
+  s->last_nack_tick = tick();
+}
+
+void spec_recv_poll(spec_t *s) {
+  uint8_t buff[HEADER_SIZE + MAX_RUN * NPLAYER];
+  struct sockaddr_in from;
+  socklen_t from_len = sizeof(from);
+  ssize_t len;
+  while ((len = recvfrom(s->sock, buff, sizeof(buff), MSG_DONTWAIT,
+                         (struct sockaddr *)&from, &from_len)) > 0) {
+    from_len = sizeof(from);
+    if (len < HEADER_SIZE || buff[0] != SPEC_DATA ||
+        len != HEADER_SIZE + (ssize_t)buff[5] * NPLAYER)
+      continue;
+
+    /* The stream is the first sender's. Anyone else on the group could
+     * feed us inputs and draw our NACKs. */
+    if (!s->have_sender) {
+      s->sender_addr = from;
+      s->have_sender = true;
+    } else if (from.sin_addr.s_addr != s->sender_addr.sin_addr.s_addr ||
+               from.sin_port != s->sender_addr.sin_port) {
+      continue;
+    }
+
+    uint32_t epoch = get_epoch(buff);
+    uint32_t n = buff[5];
+    if (epoch >= MAX_EPOCH - n)
+      continue;
+    reserve(s, epoch + n);
+    memcpy(s->inputs + (size_t)epoch * NPLAYER, buff + HEADER_SIZE,
+           (size_t)n * NPLAYER);
+    memset(s->have + epoch, 1, n);
+    if (epoch + n > s->high)
+      s->high = epoch + n;
+  }
+
+  /* Joined late, or lost something: we only learn of it once a later
+   * epoch arrives. */
+  if (s->have_sender && s->next < s->high && !s->have[s->next] &&
+      tick() - s->last_nack_tick >= NACK_INTERVAL)
+    send_nack(s);
+}
+
+int spec_next(spec_t *s, cmd_t cmds[NPLAYER]) {
+  if (s->next >= s->high || !s->have[s->next])
+    return 0;
+  for (size_t i = 0; i < NPLAYER; ++i)
+    cmds[i] = s->inputs[(size_t)s->next * NPLAYER + i];
+  ++s->next;
+  return 1;
+}
+
+uint32_t spec_backlog(const spec_t *s) {
+  uint32_t n = 0;
+  while (s->next + n < s->high && s->have[s->next + n])
+    ++n;
+  return n;
+}
+
+void spec_fini(spec_t *s) {
+  if (!s)
+    return;
+  close(s->sock);
+  free(s->inputs);
+  free(s->have);
+  free(s);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include "simulate.h"
+
+#include <stdint.h>
+
+/*
+ * Spectator stream: the confirmed inputs of every epoch, multicast to a
+ * group address. Spectators re-simulate the match from the inputs and ask
+ * the sender to repeat what they missed with NACKs, which are answered to
+ * the whole group.
+ *
+ * group is an "address:port" string. Each stream is independent, so a
+ * spectator can follow several matches at once.
+ */
+
+typedef struct spec spec_t;
+
+spec_t *spec_send_init(const char *group);
+void spec_publish(spec_t *s, const cmd_t cmds[NPLAYER]);
+/* Answer NACKs and keep the stream alive while the match is stalled. */
+void spec_send_poll(spec_t *s);
+
+spec_t *spec_join(const char *group);
+/* Receive and request repairs. */
+void spec_recv_poll(spec_t *s);
+/* Returns 1 and the inputs of the next epoch if it has arrived, 0
+ * otherwise. */
+int spec_next(spec_t *s, cmd_t cmds[NPLAYER]);
+/* Number of epochs that are ready to be simulated. */
+uint32_t spec_backlog(const spec_t *s);
+
+void spec_fini(spec_t *s);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2022, 2023  Xiaoyue Chen
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "replay.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print the state after the first epoch epochs of r. */
+static int seek(const replay_file_t *r, long epoch) {
+  double start = now();
+  state_t state;
+  if (!replay_seek(r, epoch, &state)) {
+    fprintf(stderr, "the replay has only %zu epochs\n", replay_length(r));
+    return 1;
+  }
+  double elapsed = now() - start;
+  printf("epoch %ld hash %016" PRIx64 " paddles %g %g ball %g %g moving %g "
+         "%g\n",
+         epoch, sim_hash(&state), state.paddle[0].pos.y,
+         state.paddle[1].pos.y, state.ball.pos.x, state.ball.pos.y,
+         state.ball.vel.x, state.ball.vel.y);
+  fprintf(stderr, "found in %.1f us\n", elapsed * 1e6);
+  return 0;
+}
+
+/* Verify a replay block by block on every core, or print the state at one
+ * epoch. */
+int main(int argc, char *argv[argc + 1]) {
+  int nthread = sysconf(_SC_NPROCESSORS_ONLN);
+  long epoch = -1;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:e:")) != -1) {
+    switch (opt) {
+    case 'j':
+      nthread = atoi(optarg);
+      break;
+    case 'e':
+      epoch = atol(optarg);
+      if (epoch < 0)
+        optind = argc;
+      break;
+    default:
+      optind = argc;
+    }
+  }
+  if (optind != argc - 1 || nthread < 1) {
+    fprintf(stderr, "Usage: %s [-j threads] [-e epoch] replay\n", argv[0]);
+    fprintf(stderr, "  -e epoch  Print the state after the first epoch "
+                    "epochs instead\n");
+    return 1;
+  }
+
+  replay_file_t *r = replay_open(argv[optind]);
+  if (!r)
+    return 1;
+  if (epoch >= 0) {
+    int status = seek(r, epoch);
+    replay_free(r);
+    return status;
+  }
+  double start = now();
+  size_t bad = replay_verify(r, nthread);
+  double elapsed = now() - start;
+  size_t n = replay_length(r);
+  size_t nblock = (n + REPLAY_KEYFRAME - 1) / REPLAY_KEYFRAME;
+  /* replay_verify runs no more threads than there are blocks. */
+  if ((size_t)nthread > nblock)
+    nthread = nblock ? nblock : 1;
+  fprintf(stderr,
+          "%zu epochs in %zu blocks on %d threads: %zu bad, %.3f s, "
+          "%.1f ns/epoch\n",
+          n, nblock, nthread, bad, elapsed, n ? elapsed * 1e9 / n : 0.);
+  replay_free(r);
+  return bad != 0;
+}
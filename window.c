@@ -19,32 +19,90 @@
 #include "SDL_keycode.h"
 
 #include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static int win_width, win_height;
 static win_event_t we;
 
+/* Rendering is skipped while the window is hidden or minimised, and
+ * throttled to UNFOCUSED_INTERVAL while it does not have input focus. */
+static const uint32_t UNFOCUSED_INTERVAL = 100;
+static bool visible = true, focused = true;
+static uint32_t last_render_tick;
+
+/* Rectangles per match on the wall: two walls, the paddles and the ball. */
+#define WALL_RECTS (2 + NPLAYER + 1)
+/* Fraction of a cell a match fills, leaving a gap between neighbours. */
+static const float WALL_FILL = 0.9f;
+static SDL_FRect *wall_rects;
+static size_t wall_capacity;
+
+/* Time spent in each step of drawing, in performance counter ticks, while
+ * win_bench runs. */
+typedef struct timing {
+  uint64_t clear, fill, present;
+} timing_t;
+static timing_t *timing;
+
+static uint64_t lap(uint64_t *total, uint64_t since) {
+  uint64_t now = SDL_GetPerformanceCounter();
+  *total += now - since;
+  return now;
+}
+
 void win_init(int width, int height) {
   SDL_Init(SDL_INIT_VIDEO);
   window = SDL_CreateWindow("xpong", SDL_WINDOWPOS_UNDEFINED,
                             SDL_WINDOWPOS_UNDEFINED, width, height,
                             SDL_WINDOW_SHOWN);
   renderer = SDL_CreateRenderer(window, -1, 0);
+  uint32_t flags = SDL_GetWindowFlags(window);
+  visible = !(flags & (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED));
+  focused = flags & SDL_WINDOW_INPUT_FOCUS;
   win_width = width;
   win_height = height;
 }
 
 void win_fini() {
+  free(wall_rects);
   SDL_DestroyWindow(window);
   SDL_Quit();
 }
 
+static void handle_window_event(const SDL_WindowEvent *e) {
+  switch (e->event) {
+  case SDL_WINDOWEVENT_HIDDEN:
+  case SDL_WINDOWEVENT_MINIMIZED:
+    visible = false;
+    break;
+  case SDL_WINDOWEVENT_SHOWN:
+  case SDL_WINDOWEVENT_RESTORED:
+  case SDL_WINDOWEVENT_EXPOSED:
+    visible = true;
+    /* The window contents are stale, redraw on the next frame. */
+    last_render_tick = win_tick() - UNFOCUSED_INTERVAL;
+    break;
+  case SDL_WINDOWEVENT_FOCUS_GAINED:
+    focused = true;
+    break;
+  case SDL_WINDOWEVENT_FOCUS_LOST:
+    focused = false;
+    break;
+  default:
+    break;
+  }
+}
+
 win_event_t win_poll_event() {
   SDL_Event e;
   while (SDL_PollEvent(&e) != 0) {
     if (e.type == SDL_QUIT) {
       we.quit = true;
+    } else if (e.type == SDL_WINDOWEVENT) {
+      handle_window_event(&e.window);
     } else if (e.type == SDL_KEYDOWN) {
       switch (e.key.keysym.sym) {
       case SDLK_ESCAPE:
@@ -114,9 +172,24 @@ static void render_ball(SDL_Renderer *renderer, const ball_t *ball) {
   SDL_RenderFillRect(renderer, &rect);
 }
 
-void win_render(const state_t *state) {
+/* Whether to draw a frame now, see win_render. */
+static bool frame_due() {
+  if (!visible)
+    return false;
+
+  uint32_t tick = win_tick();
+  if (!focused && tick - last_render_tick < UNFOCUSED_INTERVAL)
+    return false;
+  last_render_tick = tick;
+  return true;
+}
+
+static void draw(const state_t *state) {
+  uint64_t t = timing ? SDL_GetPerformanceCounter() : 0;
   SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xff);
   SDL_RenderClear(renderer);
+  if (timing)
+    t = lap(&timing->clear, t);
 
   render_bounds(renderer, state->bound);
 
@@ -125,8 +198,129 @@ void win_render(const state_t *state) {
   }
 
   render_ball(renderer, &state->ball);
+  if (timing)
+    t = lap(&timing->fill, t);
+
+  SDL_RenderPresent(renderer);
+  if (timing)
+    lap(&timing->present, t);
+}
+
+void win_render(const state_t *state) {
+  if (frame_due())
+    draw(state);
+}
+
+/* Map a game rectangle centred on pos into the cell centred on (cx, cy). */
+static SDL_FRect wall_rect(float cx, float cy, float scale, vec_t pos,
+                           vec_t size) {
+  SDL_FRect rect = {cx + (pos.x - size.x / 2) * scale,
+                    cy - (pos.y + size.y / 2) * scale, size.x * scale,
+                    size.y * scale};
+  return rect;
+}
+
+static void draw_wall(const state_t *states, size_t n) {
+  uint64_t t = timing ? SDL_GetPerformanceCounter() : 0;
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xff);
+  SDL_RenderClear(renderer);
+  if (timing)
+    t = lap(&timing->clear, t);
+
+  if (n * WALL_RECTS > wall_capacity) {
+    wall_rects = realloc(wall_rects, n * WALL_RECTS * sizeof(*wall_rects));
+    if (!wall_rects) {
+      perror("realloc");
+      exit(1);
+    }
+    wall_capacity = n * WALL_RECTS;
+  }
+
+  size_t cols = 1;
+  while (cols * cols < n)
+    ++cols;
+  size_t rows = (n + cols - 1) / cols;
+  float cell_w = (float)win_width / cols, cell_h = (float)win_height / rows;
 
+  /* Everything is white, so the whole wall is one batch of rectangles. */
+  SDL_FRect *rect = wall_rects;
+  for (size_t i = 0; i < n; ++i) {
+    const state_t *s = &states[i];
+    float cx = (i % cols + 0.5f) * cell_w, cy = (i / cols + 0.5f) * cell_h;
+    float sx = cell_w / (2 * s->bound.x), sy = cell_h / (2 * s->bound.y + 20);
+    float scale = (sx < sy ? sx : sy) * WALL_FILL;
+
+    vec_t wall = {2 * s->bound.x, 10};
+    *rect++ = wall_rect(cx, cy, scale, (vec_t){0, s->bound.y + 5}, wall);
+    *rect++ = wall_rect(cx, cy, scale, (vec_t){0, -s->bound.y - 5}, wall);
+    for (size_t j = 0; j < NPLAYER; ++j)
+      *rect++ = wall_rect(cx, cy, scale, s->paddle[j].pos, s->paddle[j].size);
+    vec_t ball = {s->ball.radius * 2, s->ball.radius * 2};
+    *rect++ = wall_rect(cx, cy, scale, s->ball.pos, ball);
+  }
+
+  SDL_SetRenderDrawColor(renderer, 0xff, 0xff, 0xff, 0xff);
+  SDL_RenderFillRectsF(renderer, wall_rects, rect - wall_rects);
+  if (timing)
+    t = lap(&timing->fill, t);
   SDL_RenderPresent(renderer);
+  if (timing)
+    lap(&timing->present, t);
+}
+
+void win_render_wall(const state_t *states, size_t n) {
+  if (n && frame_due())
+    draw_wall(states, n);
+}
+
+static void report(const char *what, uint32_t frames, uint64_t total,
+                   const timing_t *tm) {
+  double freq = SDL_GetPerformanceFrequency();
+  double us = 1e6 / freq / frames;
+  fprintf(stderr,
+          "%-12s %6.0f fps, per frame: clear %7.1f us, fill %7.1f us, "
+          "present %7.1f us\n",
+          what, frames * freq / total, tm->clear * us, tm->fill * us,
+          tm->present * us);
+}
+
+void win_bench(const state_t *states, size_t n, uint32_t frames) {
+  if (!renderer) {
+    fprintf(stderr, "no renderer: %s\n", SDL_GetError());
+    return;
+  }
+  SDL_RendererInfo info;
+  SDL_GetRendererInfo(renderer, &info);
+  fprintf(stderr, "renderer %s, %dx%d, %zu states, %u frames\n", info.name,
+          win_width, win_height, n, (unsigned)frames);
+
+  /* The matches of a wall are consecutive stretches of the states. */
+  size_t nwall = n < WIN_BENCH_WALL ? n : WIN_BENCH_WALL;
+  state_t *wall = malloc(nwall * sizeof(*wall));
+  if (!wall) {
+    perror("malloc");
+    return;
+  }
+
+  timing_t tm = {0};
+  timing = &tm;
+  uint64_t start = SDL_GetPerformanceCounter();
+  for (uint32_t i = 0; i < frames; ++i)
+    draw(&states[i % n]);
+  report("win_render", frames, SDL_GetPerformanceCounter() - start, &tm);
+
+  char what[32];
+  snprintf(what, sizeof(what), "wall of %zu", nwall);
+  tm = (timing_t){0};
+  start = SDL_GetPerformanceCounter();
+  for (uint32_t i = 0; i < frames; ++i) {
+    for (size_t j = 0; j < nwall; ++j)
+      wall[j] = states[(i + j * (n / nwall)) % n];
+    draw_wall(wall, nwall);
+  }
+  report(what, frames, SDL_GetPerformanceCounter() - start, &tm);
+  timing = NULL;
+  free(wall);
 }
 
 uint32_t win_tick() { return SDL_GetTicks(); }
@@ -21,6 +21,7 @@
 #include "simulate.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct win_event {
@@ -33,8 +34,23 @@ void win_init(int width, int height);
 
 void win_fini();
 
+/* Draw state. Does nothing while the window is hidden or minimised, and
+ * drops frames while the window is out of focus. */
 void win_render(const state_t *state);
 
+/* Draw n matches side by side in a grid, each scaled to fit its cell, with
+ * a single draw call for the whole frame. Throttled like win_render. */
+void win_render_wall(const state_t *states, size_t n);
+
+/* Matches on the wall that win_bench draws. */
+#define WIN_BENCH_WALL 64
+
+/* Draw frames frames from the n states as fast as possible, through the
+ * same calls as win_render and then as walls of WIN_BENCH_WALL matches,
+ * and report the frame rate and the time spent clearing, filling and
+ * presenting. */
+void win_bench(const state_t *states, size_t n, uint32_t frames);
+
 /* Return ticks in milliseconds */
 uint32_t win_tick();
 
@@ -15,18 +15,27 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "feed.h"
+#include "netmode.h"
 #include "network.h"
+#include "predict.h"
+#include "replay.h"
+#include "session.h"
 #include "simulate.h"
+#include "smooth.h"
+#include "spectate.h"
 #include "unistd.h"
 #include "window.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -35,19 +44,72 @@
 static const int SCREEN_WIDTH = 720;
 static const int SCREEN_HEIGHT = 640;
 static const int SIM_INTERVAL = 10;
+/* Milliseconds per tick, SIM_INTERVAL unless -i says otherwise. Both peers
+   and spectators must agree on it. */
+static int tick_ms = SIM_INTERVAL;
+/* Epochs a spectator may lag behind the stream before it skips ahead. */
+static const uint32_t SPECTATE_LAG = 2;
+/* Window size when spectating more than one match. */
+static const int WALL_WIDTH = 1280;
+static const int WALL_HEIGHT = 960;
+/* Frames win_bench draws of each kind. */
+static const uint32_t BENCH_FRAMES = 5000;
 
 
-#define OPCODE_CMD 0
-#define OPCODE_ACK 1
-
+/* What we have of an epoch, kept in a window of NETMODE_WINDOW epochs from
+   the current one since commands are sent ahead under input delay. */
 typedef struct epoch {
   bool cmd;
   bool ack;
   bool cmd_self;
+  cmd_t cmds[NPLAYER];
 } epoch_t;
 
+/* The last acknowledgement sent for a command of the peer, kept by epoch %
+   NETMODE_WINDOW for the epochs around the current one. */
+typedef struct ack_sent {
+  bool sent;
+  uint16_t epoch;
+  uint32_t tick;
+} ack_sent_t;
+
+/* Statistics of the commands and acknowledgements we send. */
+typedef struct ack_stats {
+  uint32_t cmds, acks, held_back, implied;
+} ack_stats_t;
+
+/* Spacing of the first copies of the peer's commands for consecutive
+   epochs, by the kernel's receive timestamps. */
+typedef struct arrival_stats {
+  uint16_t epoch;
+  uint64_t last;
+  uint32_t n;
+  double sum, sum2;
+} arrival_stats_t;
+
 static void usage(const char *program_name) {
-  fprintf(stderr, "Usage: %s <self_port> <peer_hostname> <peer_port> <player>\n", program_name);
+  fprintf(stderr, "Usage: %s [-m group:port] [-j session] [-i ms] [-t] [-f] [-r path [-d]] [-x|-X us] <self_port> <peer_hostname> <peer_port> <player>\n", program_name);
+  fprintf(stderr, "       %s -s group:port [-s group:port ...]\n", program_name);
+  fprintf(stderr, "       %s -b replay [-g WIDTHxHEIGHT]\n", program_name);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -m group:port  Multicast the match to spectators (e.g. 239.0.0.1:9940)\n");
+  fprintf(stderr, "  -s group:port  Spectate a match multicast to group, repeat to watch\n");
+  fprintf(stderr, "                 several matches side by side\n");
+  fprintf(stderr, "  -j session     Peer is a relay, join session there (0-65535)\n");
+  fprintf(stderr, "  -i ms          Milliseconds per tick, the same for both peers (default 10)\n");
+  fprintf(stderr, "  -t             Send when in the tick the input changed\n");
+  fprintf(stderr, "  -f             Feed the confirmed epochs to other processes, see xpong-feed\n");
+  fprintf(stderr, "  -r path        Record a replay of the match to path\n");
+  fprintf(stderr, "  -d             Write the replay with O_DIRECT\n");
+  fprintf(stderr, "  -x us          Send commands us after their tick is due, timed by the\n");
+  fprintf(stderr, "                 kernel with SO_TXTIME where the qdisc holds them. The\n");
+  fprintf(stderr, "                 client sees a tick a millisecond or more late, and\n");
+  fprintf(stderr, "                 commands it is too late for go us after the next tick\n");
+  fprintf(stderr, "  -X us          The same, always timed in user space\n");
+  fprintf(stderr, "  -b replay      Benchmark drawing the states of a replay, with the\n");
+  fprintf(stderr, "                 renderer in SDL_RENDER_DRIVER, off screen without a display\n");
+  fprintf(stderr, "  -g WxH         Window size of the benchmark\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "Arguments:\n");
   fprintf(stderr, "  self_port      Port to listen on (e.g. 9930)\n");
@@ -58,32 +120,319 @@ static void usage(const char *program_name) {
   fprintf(stderr, "Examples:\n");
   fprintf(stderr, "  %s 9930 127.0.0.1 9931 0\n", program_name);
   fprintf(stderr, "  %s 9931 127.0.0.1 9930 1\n", program_name);
+  fprintf(stderr, "  %s -j 7 9930 relay.example.org 9900 0\n", program_name);
+  fprintf(stderr, "  %s -s 239.0.0.1:9940\n", program_name);
+}
+
+static int spectate(const char **groups, size_t n) {
+  state_t *states = malloc(n * sizeof(*states));
+  spec_t **specs = malloc(n * sizeof(*specs));
+  if (!states || !specs) {
+    perror("malloc");
+    return 1;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    states[i] = sim_init(SCREEN_WIDTH, SCREEN_HEIGHT);
+    specs[i] = spec_join(groups[i]);
+  }
+  if (n == 1)
+    win_init(SCREEN_WIDTH, SCREEN_HEIGHT);
+  else
+    win_init(WALL_WIDTH, WALL_HEIGHT);
+
+  cmd_t cmds[NPLAYER];
+  uint32_t previous_tick = win_tick();
+  while (!win_poll_event().quit) {
+    for (size_t i = 0; i < n; ++i)
+      spec_recv_poll(specs[i]);
+
+    for (; win_tick() - previous_tick > tick_ms;
+         previous_tick += tick_ms) {
+      /* Play one epoch per tick, and skip to the live match without
+         drawing after joining late or a stall. */
+      bool stepped = false;
+      for (size_t i = 0; i < n; ++i) {
+        while (spec_backlog(specs[i]) > SPECTATE_LAG &&
+               spec_next(specs[i], cmds)) {
+          states[i] = sim_update(&states[i], cmds, tick_ms / 1000.f);
+          stepped = true;
+        }
+        if (spec_next(specs[i], cmds)) {
+          states[i] = sim_update(&states[i], cmds, tick_ms / 1000.f);
+          stepped = true;
+        }
+      }
+      if (stepped && n == 1)
+        win_render(&states[0]);
+      else if (stepped)
+        win_render_wall(states, n);
+    }
+  }
+
+  for (size_t i = 0; i < n; ++i)
+    spec_fini(specs[i]);
+  free(specs);
+  free(states);
+  win_fini();
+  return 0;
+}
+
+/* Our input for the tick that began at start. held is what is held now,
+   was what was held before it changed at changed. With subtick, a change
+   during the tick says when it happened. Only the last change is kept, and
+   going straight from one command to another keeps only the second, see
+   SIM_INPUT. */
+static cmd_t tick_input(cmd_t held, cmd_t was, uint32_t changed,
+                        uint32_t start, bool subtick) {
+  int32_t since = changed - start;
+  if (since < 0)
+    return held;
+  if (since >= tick_ms)
+    return was;
+  if (!subtick)
+    return held;
+
+  uint32_t at = since * SIM_SUBTICK / tick_ms;
+  return held != CMD_NONE ? SIM_INPUT(held, at, false)
+                          : SIM_INPUT(was, at, true);
+}
+
+/* Acknowledge the peer's command for epoch, unless we did less than hold
+   ms ago. */
+static void send_ack(ack_sent_t *sent, uint16_t epoch, uint32_t hold,
+                     uint32_t tick, ack_stats_t *stats) {
+  ack_sent_t *a = &sent[epoch % NETMODE_WINDOW];
+  if (a->sent && a->epoch == epoch && tick - a->tick < hold) {
+    ++stats->held_back;
+    return;
+  }
+  net_packet_t pkt = {.opcode = OPCODE_ACK, .epoch = epoch, .input = 0};
+  net_send(&pkt);
+  *a = (ack_sent_t){.sent = true, .epoch = epoch, .tick = tick};
+  ++stats->acks;
+}
+
+/* The peer has our commands for the epochs before implied: it cannot be
+   sending commands for an epoch more than its input delay ahead of the one
+   it simulates, and it only got there with our commands. Mark those we sent
+   as acknowledged, whether or not their ACK arrives. */
+static void ack_implied(epoch_t *window, uint16_t epoch, uint16_t epoch_self,
+                        uint16_t implied, ack_stats_t *stats) {
+  for (uint16_t i = epoch; i != epoch_self && (int16_t)(implied - i) > 0;
+       ++i) {
+    epoch_t *slot = &window[i % NETMODE_WINDOW];
+    if (!slot->ack) {
+      slot->ack = true;
+      ++stats->implied;
+    }
+  }
+}
+
+/* Record the arrival at rx of the first copy of the peer's command for
+   epoch. */
+static void arrival_record(arrival_stats_t *a, uint16_t epoch, uint64_t rx) {
+  if (!rx)
+    return;
+  if (a->last && epoch == (uint16_t)(a->epoch + 1)) {
+    double spacing = (rx - a->last) / 1e3;
+    a->sum += spacing;
+    a->sum2 += spacing * spacing;
+    ++a->n;
+  }
+  a->epoch = epoch;
+  a->last = rx;
+}
+
+static void arrival_report(const arrival_stats_t *a) {
+  if (a->n < 2)
+    return;
+  double mean = a->sum / a->n;
+  double var = (a->sum2 - a->sum * mean) / (a->n - 1);
+  fprintf(stderr, "commands arrived %.1f us apart, jitter %.1f us, over %u "
+                  "epochs\n",
+          mean, sqrt(var > 0 ? var : 0), (unsigned)a->n);
+}
+
+static int bench(const char *path, int width, int height) {
+  size_t n;
+  state_t *states = replay_states(path, &n);
+  if (!states)
+    return 1;
+  if (!n) {
+    fprintf(stderr, "%s has no epochs\n", path);
+    free(states);
+    return 1;
+  }
+
+  /* Draw off screen when there is no display to draw on. */
+  if (!getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY"))
+    setenv("SDL_VIDEODRIVER", "offscreen", 0);
+  win_init(width, height);
+  win_bench(states, n, BENCH_FRAMES);
+  win_fini();
+  free(states);
+  return 0;
 }
 
 int main(int argc, char *argv[argc + 1]) {
-  if (argc != 5) {
+  const char *group_send = NULL;
+  bool feeding = false;
+  const char *replay_path = NULL;
+  bool replay_direct = false;
+  const char *bench_path = NULL;
+  bool subtick = false;
+  /* Send commands this long after their tick is due, if at all. */
+  long pace_us = -1;
+  bool pace_kernel = false;
+  int bench_width = SCREEN_WIDTH, bench_height = SCREEN_HEIGHT;
+  const char **groups_spectate = malloc(argc * sizeof(*groups_spectate));
+  size_t nspectate = 0;
+  long session = -1;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:s:j:i:tfr:db:g:x:X:")) != -1) {
+    switch (opt) {
+    case 'j':
+      session = atol(optarg);
+      break;
+    case 'r':
+      replay_path = optarg;
+      break;
+    case 'd':
+      replay_direct = true;
+      break;
+    case 'b':
+      bench_path = optarg;
+      break;
+    case 'g':
+      if (sscanf(optarg, "%dx%d", &bench_width, &bench_height) != 2 ||
+          bench_width <= 0 || bench_height <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'i':
+      tick_ms = atoi(optarg);
+      if (tick_ms <= 0 || tick_ms > 1000) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 't':
+      subtick = true;
+      break;
+    case 'f':
+      feeding = true;
+      break;
+    case 'x':
+    case 'X':
+      pace_us = atol(optarg);
+      pace_kernel = opt == 'x';
+      if (pace_us < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'm':
+      group_send = optarg;
+      break;
+    case 's':
+      groups_spectate[nspectate++] = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+#ifdef SIM_FIXED
+  if (tick_ms != 1000 / SIM_FIXED_HZ) {
+    fprintf(stderr, "the fixed-point engine runs at %d ms per tick\n",
+            1000 / SIM_FIXED_HZ);
+    return 1;
+  }
+#endif
+
+  if (pace_us > 1000L * tick_ms) {
+    fprintf(stderr, "commands must leave within their tick\n");
+    return 1;
+  }
+
+  if (session >= 0 && tick_ms != SIM_INTERVAL) {
+    fprintf(stderr, "relays run at %d ms per tick\n", SIM_INTERVAL);
+    return 1;
+  }
+
+  if (bench_path && argc == optind)
+    return bench(bench_path, bench_width, bench_height);
+  if (nspectate && argc == optind)
+    return spectate(groups_spectate, nspectate);
+  free(groups_spectate);
+
+  if (argc - optind != 4) {
     usage(argv[0]);
     return 1;
   }
-  unsigned short port_self = atoi(argv[1]);  /* 9930 */
-  const char *hostname_other = argv[2];      /* "127.0.0.1" */
-  unsigned short port_other = atoi(argv[3]); /* 9931 */
-  int player = atol(argv[4]);                /* 0 */
+  char **arg = argv + optind;
+  unsigned short port_self = atoi(arg[0]);  /* 9930 */
+  const char *hostname_other = arg[1];      /* "127.0.0.1" */
+  unsigned short port_other = atoi(arg[2]); /* 9931 */
+  int player = atol(arg[3]);                /* 0 */
   int other_player = player == 0 ? 1 : 0;
 
   
   
+  sim_selftest();
+  net_selftest();
+  fprintf(stderr, "using sim kernel %s, net codec %s\n", sim_kernel_name(),
+          net_codec_name());
+
   state_t state = sim_init(SCREEN_WIDTH, SCREEN_HEIGHT);
   win_init(SCREEN_WIDTH, SCREEN_HEIGHT);
   net_init(port_self, hostname_other, port_other);
+  if (pace_us >= 0)
+    net_pace_init(pace_kernel);
+  spec_t *spec = NULL;
+  if (group_send)
+    spec = spec_send_init(group_send);
+  feed_t *feed = feeding ? feed_create() : NULL;
+  replay_t *replay = NULL;
+  if (replay_path &&
+      !(replay = replay_create(replay_path, tick_ms, replay_direct)))
+    return 1;
 
   uint16_t epoch = 0;
-  epoch_t epoch_state = {false, false, false};
-  cmd_t cmds[2];
+  epoch_t window[NETMODE_WINDOW] = {0};
+  ack_sent_t acks[NETMODE_WINDOW] = {0};
+  ack_stats_t ack_stats = {0};
+  arrival_stats_t arrivals = {0};
+  /* Next epoch to read our own input for. */
+  uint16_t epoch_self = 0;
   bool quit = false;
+  bool joined = session < 0;
+
+  /* A relay only follows the epochs just ahead of the one it simulates. */
+  netmode_t mode;
+  netmode_init(&mode, player, tick_ms,
+               session < 0 ? NETMODE_MAX_DELAY : SESSION_MAX_DELAY);
+
+  /* Guess the peer's input each epoch to measure how often a rollback
+     client would have to re-simulate, and by how many ticks. */
+  predict_t pred;
+  predict_init(&pred, other_player);
+  cmd_t guess = predict_next(&pred, &state);
+  uint32_t spec_ticks = 0;
+
+  smooth_t smooth;
+  smooth_init(&smooth);
 
   uint32_t previous_tick = win_tick();
   uint32_t epoch_start_tick = previous_tick;
+  /* The net_clock time of win_tick 0, to time commands by. */
+  uint64_t tick_clock = net_clock() - previous_tick * 1000000ull;
+
+  /* Our input, what it was before, and when it changed. */
+  cmd_t held = CMD_NONE, was = CMD_NONE;
+  uint32_t changed_tick = previous_tick;
 
   printf("game started\n");
   printf("waiting for player %d to start the game\n", other_player);
@@ -92,77 +441,166 @@ int main(int argc, char *argv[argc + 1]) {
     win_event_t e = win_poll_event();
     if (e.quit)
       quit = true;
+    if (spec)
+      spec_send_poll(spec);
+    net_pace_poll();
 
-    for (; win_tick() - previous_tick > SIM_INTERVAL;
-        previous_tick += SIM_INTERVAL) {
-      /*
-       * TODO: Poll and handle each packet until no more packet.
-       *
-       * If we receive a command packet, send an acknowledgement packet, mark
-       * its flag in epoch_state, and set the command in cmds array. If we
-       * receive a acknowledge packet, just mark its flag in epoch_state.
-       */
-      
-      while ((!epoch_state.cmd || !epoch_state.ack) && net_poll(&pkt)) {
-        if (pkt.epoch == epoch) {
-          switch (pkt.opcode) {
-            case OPCODE_CMD:
-              epoch_state.cmd = true;
-              cmds[other_player] = pkt.input;
-              pkt.opcode = OPCODE_ACK;
-              pkt.epoch = epoch;
-              pkt.input = 0;
-              net_send(&pkt);
-              break;
-            case OPCODE_ACK:
-              epoch_state.ack = true;
-              break;
-          }
-        }
-      }
+    cmd_t now = e.up ? CMD_UP : e.down ? CMD_DOWN : CMD_NONE;
+    if (now != held) {
+      was = held;
+      held = now;
+      changed_tick = win_tick();
+    }
 
-      /* TODO: Update cmds[player] and set cmd_self in epoch_state if cmd_self
-         is not set */
-      
-      if (!epoch_state.cmd_self) {
-        if (e.up) {
-          cmds[player] = CMD_UP;
-        } else if (e.down) {
-          cmds[player] = CMD_DOWN;
-        } else {
-          cmds[player] = CMD_NONE;
+    /*
+     * TODO: Poll and handle each packet until no more packet.
+     *
+     * If we receive a command packet, send an acknowledgement packet, mark
+     * its flag in epoch_state, and set the command in cmds array. If we
+     * receive a acknowledge packet, just mark its flag in epoch_state.
+     */
+    while (net_poll(&pkt)) {
+      /* A command no client sends, which the relay drops as well. */
+      if (pkt.opcode == OPCODE_CMD && SIM_INPUT_CMD(pkt.input) > CMD_DOWN)
+        continue;
+      uint16_t ahead = pkt.epoch - epoch, behind = epoch - pkt.epoch;
+      epoch_t *slot = &window[pkt.epoch % NETMODE_WINDOW];
+      if (pkt.opcode == OPCODE_JOIN && pkt.input == JOIN_REJECT) {
+        fprintf(stderr, "relay has no room for session %ld\n", session);
+        quit = true;
+      } else if (pkt.opcode == OPCODE_JOIN) {
+        joined = true;
+      } else if (netmode_handle(&mode, &pkt, win_tick())) {
+        continue;
+      } else if (ahead < NETMODE_WINDOW) {
+        switch (pkt.opcode) {
+          case OPCODE_CMD: {
+            /* The first copy is ACKed at once. The peer repeats its command
+               every tick until the ACK arrives, so a repeat only needs
+               another ACK once the first has had a round trip to get
+               there. */
+            bool repeat = slot->cmd;
+            if (!repeat)
+              arrival_record(&arrivals, pkt.epoch, net_rx_time());
+            slot->cmd = true;
+            slot->cmds[other_player] = pkt.input;
+            ack_implied(window, epoch, epoch_self,
+                        pkt.epoch - netmode_peer_delay(&mode), &ack_stats);
+            send_ack(acks, pkt.epoch, repeat ? netmode_rtt(&mode) : 0,
+                     win_tick(), &ack_stats);
+            break;
+          }
+          case OPCODE_ACK:
+            slot->ack = true;
+            break;
         }
-
-        epoch_state.cmd_self = true;
+      } else if (pkt.opcode == OPCODE_CMD && behind <= NETMODE_WINDOW) {
+        /* Our ACK for a past epoch got lost or is still on its way. The
+           commands we sent since tell the peer as much, so only repeat the
+           ACK if those are late too. */
+        uint16_t newest = epoch_self - 1;
+        bool implied = (int16_t)(newest - netmode_peer_delay(&mode) -
+                                 pkt.epoch) > 0;
+        send_ack(acks, pkt.epoch, implied ? netmode_rtt(&mode) : 0,
+                 win_tick(), &ack_stats);
       }
+    }
 
-      /* TODO: Send a command packet. */
-      pkt.opcode = OPCODE_CMD;
-      pkt.epoch = epoch;
-      pkt.input = cmds[player];
-      net_send(&pkt);
+    for (; win_tick() - previous_tick > tick_ms;
+        previous_tick += tick_ms) {
+      if (!joined)
+        net_join(session, player);
 
       /* TODO: Add conditions for simulation. To simulate and move onto the next
          epoch, we must have received the command packet and the acknowledge
          packet from the other player. */
-
-      if (epoch_state.cmd && epoch_state.ack) {
+      epoch_t *current = &window[epoch % NETMODE_WINDOW];
+      if (current->cmd && current->ack && current->cmd_self) {
         uint32_t epoch_end_tick = win_tick();
         fprintf(stderr, "epoch %u took %u ms\n", (unsigned)epoch,
                 (unsigned)(epoch_end_tick - epoch_start_tick));
         epoch_start_tick = epoch_end_tick;
 
-        state = sim_update(&state, cmds, SIM_INTERVAL / 1000.f);
+        predict_update(&pred, &state, guess, current->cmds[other_player],
+                       spec_ticks);
+        if (replay)
+          replay_append(replay, &state, current->cmds);
+        state = sim_update(&state, current->cmds, tick_ms / 1000.f);
+        if (spec)
+          spec_publish(spec, current->cmds);
+        if (feed)
+          feed_publish(feed, current->cmds, sim_hash(&state));
         //printf("epoch: %d\nplayer 0: %d\nplayer 1: %d\n", epoch, cmds[0], cmds[1]);
+        memset(current, 0, sizeof(*current));
         ++epoch;
-        epoch_state.cmd_self = epoch_state.cmd = epoch_state.ack = false;
+        guess = predict_next(&pred, &state);
+        spec_ticks = 0;
+
+        win_render(smooth_confirm(&smooth, &state, tick_ms / 1000.f));
+      } else {
+        /* Keep the ball moving while we wait. */
+        const state_t *shown = smooth_stall(&smooth, &state, tick_ms / 1000.f);
+        if (shown)
+          win_render(shown);
+        if (!current->cmd)
+          ++spec_ticks;
+      }
+
+      /* TODO: Update cmds[player] and set cmd_self in epoch_state if cmd_self
+         is not set */
+      /* Our input goes to the epoch delay ticks ahead. Epochs skipped when
+         the delay grows repeat it, and when it shrinks we wait until the
+         epochs we already sent are played. */
+      uint8_t delay = netmode_delay(&mode, epoch);
+      cmd_t input =
+          tick_input(held, was, changed_tick, previous_tick, subtick);
+      for (; (uint16_t)(epoch_self - epoch) <= delay; ++epoch_self) {
+        epoch_t *slot = &window[epoch_self % NETMODE_WINDOW];
+        slot->cmds[player] = input;
+        slot->cmd_self = true;
+        input = held;
+      }
 
-        win_render(&state);
+      /* TODO: Send a command packet. */
+      /* Paced, they leave at the same point of every tick however late
+         we got round to this one. We only get here a millisecond or more
+         after the tick is due, so if that point has passed they leave at
+         the same point of the next tick still ahead. */
+      uint64_t due = tick_clock +
+                     (uint32_t)(previous_tick + tick_ms) * 1000000ull +
+                     pace_us * 1000;
+      for (uint64_t now = net_clock(); pace_us >= 0 && due < now;)
+        due += tick_ms * 1000000ull;
+      for (uint16_t i = epoch; i != epoch_self; ++i) {
+        if (window[i % NETMODE_WINDOW].ack)
+          continue;
+        pkt.opcode = OPCODE_CMD;
+        pkt.epoch = i;
+        pkt.input = window[i % NETMODE_WINDOW].cmds[player];
+        if (pace_us >= 0)
+          net_send_at(&pkt, due);
+        else
+          net_send(&pkt);
+        ++ack_stats.cmds;
       }
+
+      netmode_poll(&mode, epoch, win_tick());
     }
   }
 
+  predict_report(&pred);
+  smooth_report(&smooth);
+  netmode_report(&mode);
+  arrival_report(&arrivals);
+  net_pace_report();
+  fprintf(stderr, "sent %u commands and %u ACKs, held back %u repeated "
+                  "ACKs, %u commands acknowledged by the peer's commands\n",
+          (unsigned)ack_stats.cmds, (unsigned)ack_stats.acks,
+          (unsigned)ack_stats.held_back, (unsigned)ack_stats.implied);
+  spec_fini(spec);
+  feed_close(feed);
+  bool recorded = replay_close(replay, &state);
   net_fini();
   win_fini();
-  return 0;
+  return !recorded;
 }